@@ -0,0 +1,156 @@
+/*
+Dispatch of the Pomodoro Tracker 0.1 lifecycle on the host: the transition table of pomodoro_lifecycle.h against the flags and branches the
+sketch had before it(pomodoroRunning, breakRunning, stopped).
+
+Both engines go through the same events, with actions that only count, and have to end every event in the same phase. Reported are
+nanoseconds per event dispatched and per loop pass without event, the steady state of the sketch. A host is not an ATmega328, the numbers
+tell how the two compare, not how long the sketch takes.
+
+Usage:
+  g++ -std=gnu++11 -O2 -o lifecycle_benchmark lifecycle_benchmark.cpp
+  ./lifecycle_benchmark [events=10000000]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Actions of the table, they only count so the engine is what is measured */
+volatile unsigned long actionsDone = 0;
+void soundSadBuzzer(void) { actionsDone++; }
+void finishPomodoro(void) { actionsDone++; }
+void makeBreakFinishedLightGame(void) { actionsDone++; }
+void enterStop(void) { actionsDone++; }
+void leaveStop(void) { actionsDone++; }
+void startPomodoro(void) { actionsDone++; }
+void leavePomodoro(void) { actionsDone++; }
+void startBreak(void) { actionsDone++; }
+void leaveBreak(void) { actionsDone++; }
+
+#include "pomodoro_lifecycle.h"
+
+// events as the loop sees them, no event most of the passes
+#define NO_EVENT PHASE_EVENTS
+
+/* Table */
+uint8_t tablePhase = STOPPED;
+
+void tablePass(uint8_t event) {
+  if(event == BUTTON_PRESSED) {
+    runPhaseTransition(&tablePhase, BUTTON_PRESSED);
+  } else if(tablePhase == POMODORO_RUNNING || tablePhase == BREAK_RUNNING) {
+    // checkCurrentPomodoro() or checkCurrentBreak(), the time may be up
+    if(event == PHASE_TIME_UP) {
+      runPhaseTransition(&tablePhase, PHASE_TIME_UP);
+    }
+  }
+}
+
+/* Flags and branches, like loop() was */
+bool pomodoroRunning = false;
+bool breakRunning = false;
+bool stopped = true;
+
+void branchesPass(uint8_t event) {
+  if(pomodoroRunning) {
+    if(event == BUTTON_PRESSED) {
+      // cancelCurrentPomodoro()
+      soundSadBuzzer();
+      leavePomodoro();
+      pomodoroRunning = false;
+      stopped = true;
+      enterStop();
+    } else if(event == PHASE_TIME_UP) {
+      // checkCurrentPomodoro() with the time up
+      finishPomodoro();
+      leavePomodoro();
+      pomodoroRunning = false;
+      breakRunning = true;
+      startBreak();
+    }
+  } else if(breakRunning) {
+    if(event == BUTTON_PRESSED) {
+      // cancelBreak()
+      leaveBreak();
+      breakRunning = false;
+      stopped = true;
+      enterStop();
+    } else if(event == PHASE_TIME_UP) {
+      // finishBreak()
+      makeBreakFinishedLightGame();
+      leaveBreak();
+      breakRunning = false;
+      stopped = true;
+      enterStop();
+    }
+  } else if(stopped) {
+    if(event == BUTTON_PRESSED) {
+      leaveStop();
+      stopped = false;
+      pomodoroRunning = true;
+      startPomodoro();
+    }
+  }
+}
+
+uint8_t branchesPhase() {
+  return(pomodoroRunning ? POMODORO_RUNNING : breakRunning ? BREAK_RUNNING : STOPPED);
+}
+
+// Both engines with a pomodoro running, like the sketch most of the time.
+void runPomodoro() {
+  tablePhase = STOPPED;
+  pomodoroRunning = false;
+  breakRunning = false;
+  stopped = true;
+  tablePass(BUTTON_PRESSED);
+  branchesPass(BUTTON_PRESSED);
+}
+
+double nanoseconds(const struct timespec* start, const struct timespec* end) {
+  return((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec));
+}
+
+// Time of a run of passes of an engine, in nanoseconds per pass.
+double measure(void (*pass)(uint8_t), const uint8_t* events, long count) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(long index = 0; index < count; index++) {
+    pass(events[index]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return(nanoseconds(&start, &end) / count);
+}
+
+int main(int argc, char** argv) {
+  long count = argc > 1 ? atol(argv[1]) : 10000000;
+  uint8_t* events = (uint8_t*)malloc(count);
+  uint8_t* idle = (uint8_t*)malloc(count);
+  // same pseudo random events every run
+  unsigned long seed = 1;
+  for(long index = 0; index < count; index++) {
+    seed = seed * 1103515245 + 12345;
+    events[index] = (seed >> 16) % 2 == 0 ? BUTTON_PRESSED : PHASE_TIME_UP;
+    idle[index] = NO_EVENT;
+  }
+  // both have to agree on every phase
+  for(long index = 0; index < count && index < 100000; index++) {
+    tablePass(events[index]);
+    branchesPass(events[index]);
+    if(tablePhase != branchesPhase()) {
+      printf("engines disagree at event %ld\n", index);
+      return(1);
+    }
+  }
+  runPomodoro();
+  double tableEvent = measure(tablePass, events, count);
+  double branchesEvent = measure(branchesPass, events, count);
+  runPomodoro();
+  double tablePassTime = measure(tablePass, idle, count);
+  double branchesPassTime = measure(branchesPass, idle, count);
+  printf("%-10s %14s %14s\n", "engine", "ns per event", "ns per pass");
+  printf("%-10s %14.2f %14.2f\n", "table", tableEvent, tablePassTime);
+  printf("%-10s %14.2f %14.2f\n", "branches", branchesEvent, branchesPassTime);
+  free(events);
+  free(idle);
+  return(0);
+}
@@ -0,0 +1,88 @@
+/*
+Pomodoro Tracker 0.1 lifecycle, shared by the sketch and the host programs(see lifecycle_benchmark.cpp), so both run the same table.
+
+The phases, the events that move the tracker between them and what is done on the way. Who includes it declares the actions named in the
+tables before, and keeps the phase going on, runPhaseTransition() moves it.
+*/
+#ifndef POMODORO_LIFECYCLE_H
+#define POMODORO_LIFECYCLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// phases of the tracker and the events that move it between them
+typedef enum { STOPPED, POMODORO_RUNNING, BREAK_RUNNING, PHASES } Phase;
+typedef enum { BUTTON_PRESSED, PHASE_TIME_UP, PHASE_EVENTS } PhaseEvent;
+
+// Every phase with every event, exactly once and in the order of the enums: phase, event, next phase, action. Going through a transition runs
+// its action while the old phase is still shown, then leaves the old phase and enters the new one. A transition to the same phase without
+// action ignores the event.
+#define PHASE_TRANSITIONS \
+  PHASE_TRANSITION(STOPPED,          BUTTON_PRESSED, POMODORO_RUNNING, NULL) \
+  PHASE_TRANSITION(STOPPED,          PHASE_TIME_UP,  STOPPED,          NULL) \
+  PHASE_TRANSITION(POMODORO_RUNNING, BUTTON_PRESSED, STOPPED,          soundSadBuzzer) \
+  PHASE_TRANSITION(POMODORO_RUNNING, PHASE_TIME_UP,  BREAK_RUNNING,    finishPomodoro) \
+  PHASE_TRANSITION(BREAK_RUNNING,    BUTTON_PRESSED, STOPPED,          NULL) \
+  PHASE_TRANSITION(BREAK_RUNNING,    PHASE_TIME_UP,  STOPPED,          makeBreakFinishedLightGame)
+
+// What is done when a phase is entered and left, in the order of the enum: phase, enter, leave.
+#define PHASE_ACTIONS \
+  PHASE_ACTION(STOPPED,          enterStop,     leaveStop) \
+  PHASE_ACTION(POMODORO_RUNNING, startPomodoro, leavePomodoro) \
+  PHASE_ACTION(BREAK_RUNNING,    startBreak,    leaveBreak)
+
+// The tables are positional. A transition repeated doesn't compile(same enumerator twice), one missing doesn't pass the count and one out of
+// place doesn't pass its position. Same for the phase actions.
+#define PHASE_TRANSITION(phase, event, next, action) phase##_##event,
+enum { PHASE_TRANSITIONS PHASE_TRANSITIONS_LISTED };
+#undef PHASE_TRANSITION
+static_assert(PHASE_TRANSITIONS_LISTED == PHASES * PHASE_EVENTS, "every phase needs a transition for every event");
+#define PHASE_TRANSITION(phase, event, next, action) \
+  static_assert(phase##_##event == phase * PHASE_EVENTS + event, "transitions go by phase and then by event, in the order of the enums");
+PHASE_TRANSITIONS
+#undef PHASE_TRANSITION
+
+#define PHASE_ACTION(phase, enter, leave) phase##_ACTIONS,
+enum { PHASE_ACTIONS PHASE_ACTIONS_LISTED };
+#undef PHASE_ACTION
+static_assert((int)PHASE_ACTIONS_LISTED == (int)PHASES, "every phase needs its enter and leave actions");
+#define PHASE_ACTION(phase, enter, leave) static_assert((int)phase##_ACTIONS == (int)phase, "phase actions go in the order of the enum");
+PHASE_ACTIONS
+#undef PHASE_ACTION
+
+typedef struct {
+  uint8_t next;
+  void (*action)(void);
+} PhaseTransition;
+
+typedef struct {
+  void (*enter)(void);
+  void (*leave)(void);
+} PhaseActions;
+
+// transition of a phase with an event is at phase * PHASE_EVENTS + event
+#define PHASE_TRANSITION(phase, event, next, action) {next, action},
+constexpr PhaseTransition phaseTransitions[PHASES * PHASE_EVENTS] = { PHASE_TRANSITIONS };
+#undef PHASE_TRANSITION
+
+#define PHASE_ACTION(phase, enter, leave) {enter, leave},
+constexpr PhaseActions phaseActions[PHASES] = { PHASE_ACTIONS };
+#undef PHASE_ACTION
+
+// Moves the phase with an event, as PHASE_TRANSITIONS says. Returns false if the phase ignores the event.
+inline bool runPhaseTransition(uint8_t* phase, uint8_t event) {
+  const PhaseTransition* transition = &phaseTransitions[*phase * PHASE_EVENTS + event];
+  if(transition->next == *phase && transition->action == NULL) {
+    // nothing to do with this event in this phase
+    return(false);
+  }
+  if(transition->action != NULL) {
+    transition->action();
+  }
+  phaseActions[*phase].leave();
+  *phase = transition->next;
+  phaseActions[*phase].enter();
+  return(true);
+}
+
+#endif
@@ -39,7 +39,11 @@ Funcionamiento
 * El inicio de los pomodoros es manual.
 * Se entra en descanso con el botón paro el descanso y si lo presiono una vez mas comienzo el nuevo lapso laboral.
 * A los 12 pomodoros se hace un juego de luces y buzzer, a los 22 hace otro juego de luces y buzzer.
-* Cuando el switch se setea off el contador se reinicia a 0.
+* Cuando el switch se setea off por más de un minuto el contador se reinicia a 0.
+* El contador y el proceso actual se guardan en la EEPROM(checkpoints), si se corta la luz al volver a encender el switch se continúa donde se
+  había quedado. Si el switch ya estaba apagado cuando se cortó, se continúa sólo si se enciende antes de un minuto como con cualquier
+  apagado. Los checkpoints rotan entre 32 slots para no gastar la EEPROM, se escriben en cada cambio de proceso, al prender y apagar el
+  switch y cada 5 minutos.
 * Los leds verdes indican el progreso del pomodoro, cuando termine el pomodoro van a oscilar 5 veces y switchear a la parte break.
 * Cuando se enciende(switch on) se realiza un juego de luces.
 * Si un led azul está encendido se está en proceso de break corto, si los dos están encendidos se está en un break largo.
@@ -53,25 +57,62 @@ Funcionamiento
 
 // include aliases of sounds as frecuencies
 #include "pitches.h"
+// checkpoints are kept in the EEPROM
+#include <avr/eeprom.h>
+#include <stddef.h>
 
 /* Function prototypes */
 void checkSwitch(void);
 void checkButton(void);
+void dispatchPhaseEvent(byte event);
 void startPomodoro(void);
+void leavePomodoro(void);
+void finishPomodoro(void);
 void resetEverything(void);
-void cancelCurrentPomodoro(void);
 void checkCurrentPomodoro(void);
 void startBreak(void);
+void leaveBreak(void);
 void makePomodoroFinishedLightGame(void);
-void cancelBreak(void);
 void checkCurrentBreak(void);
 void makeSystemOnLightGame(void);
 void makePomodoroN12FinishedLightGame(void);
 void makePomodoroN22FinishedLightGame(void);
 void makeBreakFinishedLightGame(void);
-void finishBreak(void);
+void enterStop(void);
+void leaveStop(void);
 void soundSadBuzzer(void);
 void soundHappyBuzzer(void);
+void turnOffLeds(void);
+void showCurrentPhase(void);
+void saveCheckpoint(void);
+void loadCheckpoint(void);
+byte checkpointCrc(const byte* data, byte length);
+
+// a checkpoint is saved at least this often while a pomodoro or break is running
+#define CHECKPOINT_INTERVAL 300000
+// EEPROM slots the checkpoints rotate through, each one is 8 bytes long
+#define CHECKPOINT_SLOTS 32
+#define CHECKPOINT_ADDRESS 0
+// the switch has to be off this long to reset the counter, so a blip or a quick toggle doesn't lose it
+#define SWITCH_OFF_RESET_TIME 60000
+// checkpoint flags, the switch was off when it was saved
+#define CHECKPOINT_SWITCHED_OFF 0x01
+
+/* Pomodoro lifecycle */
+// phases, events and the transition table, see PHASE_TRANSITIONS
+#include "pomodoro_lifecycle.h"
+
+// What is saved of the tracker. Slots are written in turn, the one with the highest sequence and a good crc is the last one.
+typedef struct {
+  unsigned int sequence;
+  byte pomodorosFinished;
+  // 'R' pomodoro running, 'B' break running, 'S' stopped
+  char phase;
+  unsigned int phaseSeconds;
+  // CHECKPOINT_SWITCHED_OFF, 0 in checkpoints saved before there were flags
+  byte flags;
+  byte crc;
+} Checkpoint;
 
 /* Global variables */
 int switchInitialPosition = 0;
@@ -82,15 +123,21 @@ int pomodorosFinished = 0;
 bool buttonCensusOn = true;
 // is the button pressed? Start as off, but at the very beginning is checked
 bool buttonPressed = false;
-// is a pomodoro currently running?
-bool pomodoroRunning = false;
-// or there is a break right now?
-bool breakRunning = false;
-// or a stop is currently happening?
-bool stopped = true;
+// phase going on, see PHASE_TRANSITIONS
+byte phase = STOPPED;
 unsigned long lastTimeButtonWasPressed = 0;
 unsigned long startTimeOfCurrentPomodoro = 0;
 unsigned long startTimeOfCurrentBreak = 0;
+// when the switch was turned off, a pending reset happens if it stays off long enough
+bool switchOffResetPending = false;
+unsigned long switchOffTime = 0;
+// checkpoint ring, the next slot to write and the sequence it will have
+byte nextCheckpointSlot = 0;
+unsigned int nextCheckpointSequence = 0;
+unsigned long lastCheckpointTime = 0;
+// a phase loaded from the EEPROM goes on from its seconds when the system is turned on
+bool checkpointResumePending = false;
+unsigned int checkpointPhaseSeconds = 0;
 
 
 /* Arduino functions*/
@@ -108,6 +155,9 @@ void setup() {
   pinMode(12, OUTPUT);
   // system never start "on", doesn't matter in which position is the switch, its turning-on depends on the contrary state in which it begins
   switchInitialPosition = digitalRead(8);
+  // go on from the last checkpoint, if any. If the switch was off when the power went it only goes on if it is turned on in time, like after
+  // any other turn off
+  loadCheckpoint();
 }
 
 // This can run 16000 times per second, but most of the time runs twice per second.
@@ -118,41 +168,29 @@ void loop() {
   checkButton();
   // main process
   if(systemOn) {
-    // what is currently happening?
-    if(pomodoroRunning) {
-      if(buttonPressed) {
-        cancelCurrentPomodoro();
-        // event realized
-        buttonPressed = false;
-      } else {
-        // check how many time has passed since start time of current pomodoro, turn on led if needed, or finish it is 25 minutes has been reached
-        checkCurrentPomodoro();
-      }
-    } else if(breakRunning) {
-      if(buttonPressed) {
-        // break the break
-        cancelBreak();
-        // event realized
-        buttonPressed = false;
-      } else {
-        // check current break, may be finished
-        checkCurrentBreak();
-      }
-    } else if(stopped) {
-      // only if button is currently pushed this state will change
-      if(buttonPressed) {
-        // shut off stop led
-        digitalWrite(7, LOW);
-        // system should not be stopped now, start pomodoro
-        stopped = false;
-        startPomodoro();
-        // event realized
-        buttonPressed = false;
-      }
+    if(buttonPressed) {
+      // the button starts a pomodoro when stopped, and stops whatever is running otherwise
+      dispatchPhaseEvent(BUTTON_PRESSED);
+      // event realized
+      buttonPressed = false;
+    } else if(phase == POMODORO_RUNNING) {
+      // check how many time has passed since start time of current pomodoro, turn on led if needed, or finish it is 25 minutes has been reached
+      checkCurrentPomodoro();
+    } else if(phase == BREAK_RUNNING) {
+      // check current break, may be finished
+      checkCurrentBreak();
+    }
+    if(phase != STOPPED && (millis() - lastCheckpointTime) >= CHECKPOINT_INTERVAL) {
+      saveCheckpoint();
     }
   } else {
-    // shut down everything and reset some variables
-    resetEverything();
+    // shut down leds
+    turnOffLeds();
+    // and reset everything if the switch has been off long enough
+    if(switchOffResetPending && (millis() - switchOffTime) >= SWITCH_OFF_RESET_TIME) {
+      switchOffResetPending = false;
+      resetEverything();
+    }
   }
 }
 
@@ -165,12 +203,21 @@ void checkSwitch() {
     if(digitalRead(8) == switchInitialPosition) {
       // the initial position is reached again
       systemOn = false;
+      switchOffResetPending = true;
+      switchOffTime = millis();
+      // so a power cut while off still resets the counter
+      saveCheckpoint();
     }
   } else {
     if(digitalRead(8) != switchInitialPosition) {
       systemOn = true;
+      switchOffResetPending = false;
       // execute light game on on
       makeSystemOnLightGame();
+      // and show again what was going on before the switch was turned off
+      showCurrentPhase();
+      // a power cut from now on goes on where it was
+      saveCheckpoint();
     }
   }
 }
@@ -220,18 +267,28 @@ void checkButton() {
   }
 }
 
-// Casted when button pressed while a pomodoro is running.
-void cancelCurrentPomodoro() {
-  pomodoroRunning = false;
-  stopped = true;
-  // turn on stop led
-  digitalWrite(7, HIGH);
+// Moves the lifecycle with an event, as PHASE_TRANSITIONS says, and saves where it went.
+void dispatchPhaseEvent(byte event) {
+  if(runPhaseTransition(&phase, event)) {
+    saveCheckpoint();
+  }
+}
+
+// A pomodoro stops, both when cancelled and finished.
+void leavePomodoro() {
   // turn off leds
   digitalWrite(2, LOW);
   digitalWrite(3, LOW);
   digitalWrite(4, LOW);
-  // buzzer is not happy :(
-  soundSadBuzzer();
+}
+
+// The red led denotes the stop.
+void enterStop() {
+  digitalWrite(7, HIGH);
+}
+
+void leaveStop() {
+  digitalWrite(7, LOW);
 }
 
 // :( Why did you interrupted that pomodoro? Bio meaby? Is ok...
@@ -261,24 +318,8 @@ void checkCurrentPomodoro() {
   // check how many time has passed since pomodoro beginning
   unsigned long pomodoroCurrentTimeCount = millis() - startTimeOfCurrentPomodoro;
   if(pomodoroCurrentTimeCount >= 1500000) {
-    // pomodoro completed
-    pomodorosFinished++;
-    // make the happy sound
-    soundHappyBuzzer();
-    // make the light game, I'll refuse the census of the button here
-    makePomodoroFinishedLightGame();
-    pomodoroRunning = false;
-    // check out if this is the pomodoro number 12 or 22
-    switch(pomodorosFinished) {
-      case 12 :
-        makePomodoroN12FinishedLightGame();
-        break;
-      case 22 :
-        makePomodoroN22FinishedLightGame();
-        break;   
-    }
-    // begin break
-    startBreak();
+    // pomodoro completed, the break begins
+    dispatchPhaseEvent(PHASE_TIME_UP);
   } else if(pomodoroCurrentTimeCount >= 1080000) {
     // turn green led #3 on
     digitalWrite(4, HIGH);
@@ -288,6 +329,24 @@ void checkCurrentPomodoro() {
   }
 }
 
+// Celebrated when a pomodoro reaches its 25 minutes, before its break.
+void finishPomodoro() {
+  pomodorosFinished++;
+  // make the happy sound
+  soundHappyBuzzer();
+  // make the light game, I'll refuse the census of the button here
+  makePomodoroFinishedLightGame();
+  // check out if this is the pomodoro number 12 or 22
+  switch(pomodorosFinished) {
+    case 12 :
+      makePomodoroN12FinishedLightGame();
+      break;
+    case 22 :
+      makePomodoroN22FinishedLightGame();
+      break;   
+  }
+}
+
 // Yes! Completed!
 void soundHappyBuzzer() {
   // setup of notes
@@ -381,7 +440,6 @@ void makePomodoroN22FinishedLightGame() {
 
 // When a pomodoro finish, the break start.
 void startBreak() {
-  breakRunning = true;
   // inquire what pomodor break is this, may be a long one
   if((pomodorosFinished % 4) == 0) {
     // long one
@@ -395,15 +453,11 @@ void startBreak() {
   startTimeOfCurrentBreak = millis();
 }
 
-// Triggered when button is pressed while a break is happening.
-void cancelBreak() {
+// A break stops, both when cancelled and finished.
+void leaveBreak() {
   // turn off blue leds
-  breakRunning = false;
   digitalWrite(5, LOW);
   digitalWrite(6, LOW);
-  // turn on thy stop red led
-  stopped = true;
-  digitalWrite(7, HIGH);
 }
 
 // In every main loop check if break has finished.
@@ -413,30 +467,17 @@ void checkCurrentBreak() {
     // long break
     if((millis() - startTimeOfCurrentBreak) >= 900000) {
       // break is done
-      finishBreak();
+      dispatchPhaseEvent(PHASE_TIME_UP);
     }
   } else {
     // short break
     if((millis() - startTimeOfCurrentBreak) >= 300000) {
       // break is done
-      finishBreak();
+      dispatchPhaseEvent(PHASE_TIME_UP);
     }
   }
 }
 
-// Break is finished so do this.
-void finishBreak() {
-  // make the dance
-  makeBreakFinishedLightGame();
-  // turn blue leds off
-  digitalWrite(5, LOW);
-  digitalWrite(6, LOW);
-  breakRunning = false;
-  // turn stop red led on
-  digitalWrite(7, HIGH);
-  stopped = true;
-}
-
 // Triggered when break time is done.
 void makeBreakFinishedLightGame() {
   for(int counter = 0; counter < 2; counter++) {
@@ -451,8 +492,6 @@ void makeBreakFinishedLightGame() {
 
 // Called after a button press while current state is stopped.
 void startPomodoro() {
-  // pomodoro is now running
-  pomodoroRunning = true;
   // the button will be holding for 1 second until next census, so this can be done quietly
   digitalWrite(2, HIGH);
   delay(500);
@@ -463,11 +502,19 @@ void startPomodoro() {
   startTimeOfCurrentPomodoro = millis();
 }
 
-// Called when system has been turned off. Resets everything to its pristine status.
+// Called when system has been turned off for SWITCH_OFF_RESET_TIME. Resets everything to its pristine status, checkpoint included.
 void resetEverything() {
   // reset/initialize some variables
   pomodorosFinished = 0;
+  phase = STOPPED;
+  checkpointResumePending = false;
+  saveCheckpoint();
   // and leds
+  turnOffLeds();
+}
+
+// Called while system is turned off.
+void turnOffLeds() {
   digitalWrite(2, LOW);
   digitalWrite(3, LOW);
   digitalWrite(4, LOW);
@@ -475,3 +522,98 @@ void resetEverything() {
   digitalWrite(6, LOW);
   digitalWrite(7, LOW);
 }
+
+// Called when system is turned on, after its light game. Shows the phase going on, a phase loaded from a checkpoint goes on from its seconds.
+void showCurrentPhase() {
+  if(checkpointResumePending) {
+    checkpointResumePending = false;
+    startTimeOfCurrentPomodoro = millis() - checkpointPhaseSeconds * 1000UL;
+    startTimeOfCurrentBreak = startTimeOfCurrentPomodoro;
+  }
+  if(phase == POMODORO_RUNNING) {
+    // green leds by progress, like checkCurrentPomodoro() would have turned them on
+    unsigned long pomodoroCurrentTimeCount = millis() - startTimeOfCurrentPomodoro;
+    digitalWrite(7, LOW);
+    digitalWrite(2, HIGH);
+    digitalWrite(3, pomodoroCurrentTimeCount >= 540000 ? HIGH : LOW);
+    digitalWrite(4, pomodoroCurrentTimeCount >= 1080000 ? HIGH : LOW);
+  } else if(phase == BREAK_RUNNING) {
+    // one blue led for a short break, two for a long one
+    digitalWrite(7, LOW);
+    digitalWrite(5, HIGH);
+    digitalWrite(6, (pomodorosFinished % 4) == 0 ? HIGH : LOW);
+  }
+}
+
+// Saves the counter, the phase going on and whether the switch is off in the next slot of the ring. Called on every phase change, when the
+// switch is turned on or off and every CHECKPOINT_INTERVAL while running, so with 32 slots each one is written a few times a day and the
+// EEPROM(100000 writes per byte) lasts decades.
+void saveCheckpoint() {
+  Checkpoint checkpoint;
+  checkpoint.sequence = nextCheckpointSequence;
+  checkpoint.pomodorosFinished = pomodorosFinished;
+  checkpoint.flags = systemOn ? 0 : CHECKPOINT_SWITCHED_OFF;
+  if(phase == POMODORO_RUNNING) {
+    checkpoint.phase = 'R';
+    checkpoint.phaseSeconds = (millis() - startTimeOfCurrentPomodoro) / 1000;
+  } else if(phase == BREAK_RUNNING) {
+    checkpoint.phase = 'B';
+    checkpoint.phaseSeconds = (millis() - startTimeOfCurrentBreak) / 1000;
+  } else {
+    checkpoint.phase = 'S';
+    checkpoint.phaseSeconds = 0;
+  }
+  checkpoint.crc = checkpointCrc((const byte*)&checkpoint, offsetof(Checkpoint, crc));
+  // only the bytes that changed are written
+  eeprom_update_block(&checkpoint, (void*)(CHECKPOINT_ADDRESS + nextCheckpointSlot * sizeof(Checkpoint)), sizeof(Checkpoint));
+  nextCheckpointSlot = (nextCheckpointSlot + 1) % CHECKPOINT_SLOTS;
+  nextCheckpointSequence++;
+  lastCheckpointTime = millis();
+}
+
+// Looks for the last good checkpoint at boot, it takes reading 256 bytes. A slot with a bad crc(power cut while writing it) is skipped.
+void loadCheckpoint() {
+  Checkpoint checkpoint;
+  Checkpoint lastCheckpoint;
+  bool found = false;
+  for(byte slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+    eeprom_read_block(&checkpoint, (const void*)(CHECKPOINT_ADDRESS + slot * sizeof(Checkpoint)), sizeof(Checkpoint));
+    if(checkpoint.crc != checkpointCrc((const byte*)&checkpoint, offsetof(Checkpoint, crc))) {
+      continue;
+    }
+    if(checkpoint.phase != 'R' && checkpoint.phase != 'B' && checkpoint.phase != 'S') {
+      continue;
+    }
+    // sequences wrap, newer means ahead by less than half the range
+    if(!found || (int16_t)(checkpoint.sequence - lastCheckpoint.sequence) > 0) {
+      lastCheckpoint = checkpoint;
+      nextCheckpointSlot = (slot + 1) % CHECKPOINT_SLOTS;
+      found = true;
+    }
+  }
+  if(!found) {
+    return;
+  }
+  nextCheckpointSequence = lastCheckpoint.sequence + 1;
+  pomodorosFinished = lastCheckpoint.pomodorosFinished;
+  phase = lastCheckpoint.phase == 'R' ? POMODORO_RUNNING : lastCheckpoint.phase == 'B' ? BREAK_RUNNING : STOPPED;
+  checkpointResumePending = true;
+  checkpointPhaseSeconds = lastCheckpoint.phaseSeconds;
+  // the switch was off when the power went, the time off goes on from now
+  if(lastCheckpoint.flags & CHECKPOINT_SWITCHED_OFF) {
+    switchOffResetPending = true;
+    switchOffTime = millis();
+  }
+}
+
+// CRC-8(polynomial 0x07) of a checkpoint, so a half written slot is not taken as good.
+byte checkpointCrc(const byte* data, byte length) {
+  byte crc = 0;
+  for(byte position = 0; position < length; position++) {
+    crc ^= data[position];
+    for(byte bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return(crc);
+}
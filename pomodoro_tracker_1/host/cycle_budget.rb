@@ -0,0 +1,82 @@
+# CPU cycles Pomodoro Tracker 1.0 takes in its main code paths, measured on the device, against budgets kept next to the sketch.
+#
+# Needs the sketch built with PATH_PROFILING, timer 1 counts the cycles of inspectSerialPortInput(), the show functions and composeLeds() and
+# "PRF" reports them, see the sketch. Before reading them it sends the same workload every time, every phase and a light game over them, so
+# runs compare. Counts add up since the tracker started, so restart it before. Budgets go in cycle_budgets.txt, one "<path>
+# <average|most> <cycles>" per line, on the cycles of an average run and of the longest one. size_budget.rb does the same for flash and RAM.
+#
+# Usage:
+#   ruby cycle_budget.rb <port>            report, exits with 1 if a budget is exceeded
+#   ruby cycle_budget.rb <port> --record   writes the budgets from this tracker
+require_relative "tracker_link"
+
+module CycleBudget
+  BUDGETS_PATH = File.join(__dir__, "cycle_budgets.txt")
+  # in the order of the sketch
+  PATHS = %w[inspectSerialPortInput showPomodoroRunning showBreakRunning showSystemStopped composeLeds].freeze
+  WORKLOAD = %w[00S0000 00R0000 00R0600 00R1200 01B0000 04B0000 MPFLG 04S0000 MBFLG 05R0000].freeze
+  # seconds the light games of the workload take to play, and a pomodoro to show a few seconds by itself
+  WORKLOAD_TIME = 6
+
+  # {path => {"average" => cycles, "most" => cycles, "runs" => runs}} after the workload.
+  def self.measure(link)
+    WORKLOAD.each { |code| link.send_code(code) }
+    link.flush or raise "no answer from the tracker"
+    sleep(WORKLOAD_TIME)
+    paths = ask(link, "PRF").delete_prefix("PRF").split(",").first.to_i
+    raise "the tracker times #{paths} paths, #{PATHS.size} known" unless paths == PATHS.size
+    PATHS.each_with_index.to_h do |name, path|
+      _path, runs, cycles, most = ask(link, "PRF#{path}").delete_prefix("PRF").split(",").map(&:to_i)
+      [name, {"average" => runs.zero? ? 0 : cycles / runs, "most" => most, "runs" => runs}]
+    end
+  end
+
+  def self.ask(link, code)
+    link.replies.clear
+    link.send_code(code)
+    link.flush or raise "no answer from the tracker"
+    link.replies.find { |line| line.start_with?("PRF") } or raise "no answer to #{code}, built without PATH_PROFILING?"
+  end
+
+  def self.budgets
+    return {} unless File.exist?(BUDGETS_PATH)
+    File.readlines(BUDGETS_PATH).map(&:split).reject { |words| words.empty? || words.first.start_with?("#") }
+        .to_h { |path, kind, cycles| [[path, kind], cycles.to_i] }
+  end
+
+  def self.record(counts)
+    File.open(BUDGETS_PATH, "w") do |file|
+      file.puts("# <path> <average|most> <cycles>, written by cycle_budget.rb --record")
+      counts.each { |path, count| %w[average most].each { |kind| file.puts("#{path} #{kind} #{count[kind]}") } }
+    end
+  end
+
+  # Prints every path with its budgets, returns false if any is over them.
+  def self.report(counts)
+    budgets = self.budgets
+    within = true
+    puts(format("%-24s %8s %10s %8s %10s %8s", "path", "runs", "average", "budget", "most", "budget"))
+    counts.each do |path, count|
+      over = false
+      columns = %w[average most].map do |kind|
+        budget = budgets[[path, kind]]
+        over ||= budget && count[kind] > budget
+        format("%10d %8s", count[kind], budget || "-")
+      end
+      within = false if over
+      puts(format("%-24s %8d %s %s%s", path, count["runs"], *columns, over ? "  OVER" : ""))
+    end
+    within
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  port = ARGV.first or abort("usage: ruby cycle_budget.rb <port> [--record]")
+  counts = CycleBudget.measure(TrackerLink.new(port))
+  if ARGV.include?("--record")
+    CycleBudget.record(counts)
+    puts "budgets written to #{CycleBudget::BUDGETS_PATH}"
+  else
+    exit(CycleBudget.report(counts) ? 0 : 1)
+  end
+end
@@ -0,0 +1,97 @@
+# Energy used by Pomodoro Tracker 1.0, per phase, per light game and per day, from the counters the tracker keeps("NRG").
+#
+# The tracker counts how long every led and the buzzer have been on, and how long each phase and light game has been shown with how many
+# leds on. Here they are turned into mAh with a current model: what the board draws by itself, what the buzzer draws, and what each led
+# draws, read from energy_model.txt("<board|buzzer|led0..led5> <mA>" per line, defaults below for 5V and 100 ohm resistors). Phases and light
+# games count the board for the time they were shown and their leds at the mean led current, the buzzer is only counted in the totals. Time
+# with the switch off goes to stopped.
+#
+# Usage:
+#   ruby energy_report.rb <port> [minutes]   counters since the tracker started, or over the next minutes
+require_relative "tracker_link"
+
+module EnergyReport
+  MODEL_PATH = File.join(__dir__, "energy_model.txt")
+  DEFAULT_MODEL = {"board" => 46.0, "buzzer" => 30.0, "led0" => 25.0, "led1" => 25.0, "led2" => 25.0, "led3" => 18.0, "led4" => 18.0,
+                   "led5" => 28.0}.freeze
+  LEDS = 6
+  SOURCES = %w[stopped pomodoro break system-on pomodoro-finished pomodoro-12 pomodoro-22 break-finished uploaded-0 uploaded-1 uploaded-2
+               uploaded-3].freeze
+  # counters are unsigned long milliseconds in the tracker
+  WRAP = 2**32
+  MILLIAMP_MILLISECONDS_PER_MILLIAMP_HOUR = 3_600_000.0
+
+  def self.model
+    return DEFAULT_MODEL unless File.exist?(MODEL_PATH)
+    DEFAULT_MODEL.merge(File.readlines(MODEL_PATH).map(&:split).reject { |words| words.empty? || words.first.start_with?("#") }
+                            .to_h { |name, milliamps| [name, milliamps.to_f] })
+  end
+
+  # Counters of the "NRG" line and the "NRG<source>" ones, as {uptime:, buzzer:, leds: [...], sources: {name => [millis shown, led millis]}}.
+  def self.parse(lines)
+    totals = lines.find { |line| line.match?(/\ANRG\d+(,\d+){#{LEDS + 1}}\z/) } or raise ArgumentError, "no NRG totals"
+    uptime, buzzer, *leds = totals.delete_prefix("NRG").split(",").map(&:to_i)
+    sources = SOURCES.each_with_index.to_h do |name, index|
+      line = lines.find { |candidate| candidate.start_with?("NRG#{index},") } or raise ArgumentError, "no NRG#{index} answer"
+      [name, line.split(",").drop(1).map(&:to_i)]
+    end
+    {uptime: uptime, buzzer: buzzer, leds: leds, sources: sources}
+  end
+
+  # Counters between two readings, taking the wrap of the tracker counters into account.
+  def self.difference(before, after)
+    {uptime: after[:uptime] - before[:uptime], buzzer: (after[:buzzer] - before[:buzzer]) % WRAP,
+     leds: after[:leds].zip(before[:leds]).map { |later, earlier| (later - earlier) % WRAP },
+     sources: after[:sources].to_h do |name, counters|
+       [name, counters.zip(before[:sources][name]).map { |later, earlier| (later - earlier) % WRAP }]
+     end}
+  end
+
+  # mAh of every phase and light game, of the leds, the buzzer and the board, the total and the total for 24 hours at the same rate.
+  def self.energy(counters, model = self.model)
+    led_milliamps = LEDS.times.map { |led| model.fetch("led#{led}") }
+    led_charge = counters[:leds].zip(led_milliamps).sum { |millis, milliamps| millis * milliamps }
+    led_millis = counters[:leds].sum
+    mean_led_milliamps = led_millis.zero? ? led_milliamps.sum / LEDS : led_charge / led_millis
+    sources = counters[:sources].to_h do |name, (shown, led)|
+      [name, (shown * model.fetch("board") + led * mean_led_milliamps) / MILLIAMP_MILLISECONDS_PER_MILLIAMP_HOUR]
+    end
+    leds = led_charge / MILLIAMP_MILLISECONDS_PER_MILLIAMP_HOUR
+    buzzer = counters[:buzzer] * model.fetch("buzzer") / MILLIAMP_MILLISECONDS_PER_MILLIAMP_HOUR
+    board = counters[:uptime] * model.fetch("board") / MILLIAMP_MILLISECONDS_PER_MILLIAMP_HOUR
+    total = leds + buzzer + board
+    per_day = counters[:uptime].zero? ? 0.0 : total * 86_400_000 / counters[:uptime]
+    {sources: sources, leds: leds, buzzer: buzzer, board: board, total: total, per_day: per_day}
+  end
+
+  def self.report(counters)
+    energy = self.energy(counters)
+    puts(format("%-18s %10.1f s", "measured", counters[:uptime] / 1000.0))
+    energy[:sources].each do |name, milliamp_hours|
+      shown = counters[:sources][name][0]
+      next if shown.zero?
+      puts(format("%-18s %10.3f mAh %10.1f s shown", name, milliamp_hours, shown / 1000.0))
+    end
+    %i[leds buzzer board total per_day].each { |part| puts(format("%-18s %10.3f mAh", part.to_s.tr("_", " "), energy[part])) }
+  end
+
+  # Asks for the totals and every source, a short line each.
+  def self.read(link)
+    link.replies.reject! { |reply| reply.start_with?("NRG") }
+    link.send_code("NRG")
+    SOURCES.size.times { |index| link.send_code("NRG#{index}") }
+    link.flush or raise "no answer from the tracker"
+    parse(link.replies)
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  port = ARGV.first or abort("usage: ruby energy_report.rb <port> [minutes]")
+  link = TrackerLink.new(port)
+  counters = EnergyReport.read(link)
+  if ARGV[1]
+    sleep(ARGV[1].to_f * 60)
+    counters = EnergyReport.difference(counters, EnergyReport.read(link))
+  end
+  EnergyReport.report(counters)
+end
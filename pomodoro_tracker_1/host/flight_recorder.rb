@@ -0,0 +1,113 @@
+# Post-mortem of Pomodoro Tracker 1.0: the events its flight recorder kept, merged with what the host wrote and read, in a single timeline.
+#
+# The tracker keeps its last events in RAM and "FLR" dumps them, see the sketch. Records carry the low 24 bits of the device millis, they are
+# put back with the device millis of the dump and taken to host time with the host millis of it, the estimate the tracker keeps from the
+# clock syncs. A tracker never synced is taken as read when the dump arrived. Codes are recorded by their CRC-8, the frame of the host capture
+# with the same CRC-8 and sequence nearest in time tells which code it was.
+#
+# Usage:
+#   ruby flight_recorder.rb <port> [capture.log]   the recorder, merged with a capture written by CaptureLog(see latency_tracer.rb)
+require_relative "tracker_link"
+
+module FlightRecorder
+  SIZE = 32
+  TIME_WRAP = 2**24
+  LAYERS = %w[game alert].freeze
+  LIGHT_GAMES = %w[system-on pomodoro-finished pomodoro-12 pomodoro-22 break-finished].freeze
+  UPLOADED_LIGHT_GAME = 0x80
+  PHASES = {"R" => "pomodoro running", "B" => "break running", "S" => "stopped"}.freeze
+
+  # Records of the dump as {time: host millis, kind:, high:, low:}, oldest first. header is the "FLR" answer and entries the records of the
+  # "FLR<record>" ones, read_at the host millis when the header arrived.
+  def self.decode(header, entries, read_at)
+    device_now, host_now = header.delete_prefix("FLR").split(",")
+    device_now = device_now.to_i
+    offset = (host_now == "-" ? read_at : host_now.to_i) - device_now
+    entries.map do |entry|
+      device_time = device_now - (device_now - entry[0, 6].to_i(16)) % TIME_WRAP
+      {time: device_time + offset, kind: entry[6], high: entry[7, 2].to_i(16), low: entry[9, 2].to_i(16)}
+    end
+  end
+
+  # Dumps the recorder, a short line per answer.
+  def self.read(link)
+    link.replies.reject! { |reply| reply.start_with?("FLR") }
+    header = ask(link, "FLR")
+    read_at = Time.now.to_f * 1000
+    records = header.split(",").last.to_i
+    entries = []
+    first = [records - SIZE, 0].max
+    while first < records
+      index, *batch = ask(link, "FLR#{first}").delete_prefix("FLR").split(",")
+      break if batch.empty?
+      entries.concat(batch)
+      first = index.to_i + batch.size
+    end
+    decode(header, entries, read_at)
+  end
+
+  def self.ask(link, code)
+    link.send_code(code)
+    link.flush or raise "no answer from the tracker"
+    reply = link.replies.find { |line| line.start_with?("FLR") } or raise "no answer to #{code}"
+    link.replies.delete(reply)
+  end
+
+  # Frames written by the host in a capture, as {time:, code:, sequence:}.
+  def self.frames(capture)
+    File.foreach(capture).filter_map do |entry|
+      time, direction, text = entry.chomp.split(" ", 3)
+      next unless direction == ">" && (match = text.to_s.match(/\A(?:@\d+:)?(?:#(\d+):)?(.*)\z/))
+      {time: time.to_f, code: match[2], sequence: match[1]&.to_i}
+    end
+  end
+
+  def self.describe(record, frames)
+    case record[:kind]
+    when "C", "X"
+      crc = format("%02X", record[:high])
+      sequence = record[:low] == 0xFF ? nil : record[:low]
+      frame = frames.select { |candidate| TrackerLink.checksum(candidate[:code]) == crc && (sequence.nil? || candidate[:sequence] == sequence) }
+                    .min_by { |candidate| (candidate[:time] - record[:time]).abs }
+      code = frame ? frame[:code] : "code with CRC-8 #{crc}"
+      "#{record[:kind] == "C" ? "took" : "refused"} #{code}#{" ##{sequence}" if sequence}"
+    when "K"
+      "dropped a frame of #{record[:low]} chars, bad checksum"
+    when "P"
+      "shows #{PHASES.fetch(record[:high].chr, record[:high].chr)}, #{record[:low]} pomodoros completed"
+    when "G", "E"
+      "#{record[:kind] == "G" ? "started" : "finished"} light game #{light_game(record[:low])} on the #{LAYERS.fetch(record[:high], "?")} layer"
+    when "W"
+      "switch turned #{record[:high] == 1 ? "on" : "off"}"
+    else
+      "#{record[:kind]} #{record[:high]} #{record[:low]}"
+    end
+  end
+
+  def self.light_game(number)
+    number & UPLOADED_LIGHT_GAME != 0 ? "uploaded-#{number & ~UPLOADED_LIGHT_GAME}" : LIGHT_GAMES.fetch(number, number.to_s)
+  end
+
+  # Timeline lines, tracker records and capture entries by time, from the oldest record on. Records keep their order when they have the
+  # same time.
+  def self.timeline(records, capture = nil)
+    frames = capture ? self.frames(capture) : []
+    events = records.each_with_index.map { |record, index| [record[:time], 1, index, "tracker", describe(record, frames)] }
+    if capture && (start = records.first&.dig(:time))
+      File.foreach(capture).with_index do |entry, index|
+        time, direction, text = entry.chomp.split(" ", 3)
+        next if time.to_f < start
+        events << [time.to_f, 0, index, "host", "#{direction == ">" ? "wrote" : "read"} #{text}"]
+      end
+    end
+    events.sort_by { |time, source, index, _, _| [time, source, index] }.map do |time, _, _, source, text|
+      format("%s.%03d %-7s %s", Time.at(time / 1000).strftime("%F %T"), time % 1000, source, text)
+    end
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  port = ARGV.first or abort("usage: ruby flight_recorder.rb <port> [capture.log]")
+  link = TrackerLink.new(port)
+  puts FlightRecorder.timeline(FlightRecorder.read(link), ARGV[1])
+end
@@ -0,0 +1,130 @@
+# Command latency of Pomodoro Tracker 1.0, from the host writing a traced code to the tracker writing its leds.
+#
+# The tracker answers every traced code with "TRC<trace>,<device millis when read>,<microseconds until dispatched>,<microseconds until leds
+# written>". The device times are taken to the host clock with the offset measured by the clock syncs, "CLK<host millis>" answered with
+# "CLK<host millis>,<device receive millis>,<device reply millis>", so the latency includes the serial transmission, the time waiting in the
+# receive buffer and the time on the device.
+#
+# Live, observing a link:
+#   tracer = LatencyTracer.new
+#   link.observe(tracer)
+#   link.sync_clock
+#   link.send_code("16R0288", trace: tracer.next_trace)
+#   puts tracer.report
+#
+# From captured runs, written by CaptureLog:
+#   ruby latency_tracer.rb capture.log [capture.log...]
+class LatencyTracer
+  # clock syncs kept to pick the one with the shortest round trip
+  CLOCK_SAMPLES = 8
+
+  def initialize
+    # trace => [code, host millis when first written]
+    @written = {}
+    # command type => latencies in milliseconds, end to end and on the device
+    @end_to_end = Hash.new { |hash, type| hash[type] = [] }
+    @on_device = Hash.new { |hash, type| hash[type] = [] }
+    # [round trip, device clock - host clock] of the last clock syncs
+    @clock_samples = []
+    @trace = -1
+  end
+
+  # Trace for the next code, 0 to 65535 and wrapping.
+  def next_trace
+    @trace = (@trace + 1) & 0xFFFF
+  end
+
+  # A frame was written at host time, retransmissions keep the first time.
+  def written(frame, time)
+    return unless (match = frame.match(/\A@(\d+):(?:#\d+:)?(.*)\z/))
+    @written[match[1].to_i] ||= [match[2], time]
+  end
+
+  # A line was read at host time.
+  def read(line, time)
+    case line
+    when /\ACLK(\d+),(\d+),(\d+)\z/
+      host_written, device_received, device_replied = $1.to_i, $2.to_i, $3.to_i
+      round_trip = (time - host_written) - (device_replied - device_received)
+      offset = ((device_received - host_written) + (device_replied - time)) / 2.0
+      @clock_samples = (@clock_samples << [round_trip, offset]).last(CLOCK_SAMPLES)
+    when /\ATRC(\d+),(\d+),(\d+),(\d+)\z/
+      code, written_at = @written.delete($1.to_i)
+      return unless code
+      type = command_type(code)
+      @on_device[type] << $4.to_i / 1000.0
+      offset = clock_offset
+      @end_to_end[type] << ($2.to_i + $4.to_i / 1000.0 - offset) - written_at if offset
+    end
+  end
+
+  # Table of p50, p99 and max latency per command type, in milliseconds.
+  def report
+    lines = [format("%-10s %6s %9s %9s %9s %11s", "command", "count", "p50", "p99", "max", "device p99")]
+    @on_device.keys.sort.each do |type|
+      end_to_end = @end_to_end[type].sort
+      on_device = @on_device[type].sort
+      lines << format("%-10s %6d %9s %9s %9s %11s", type, on_device.size, milliseconds(percentile(end_to_end, 50)),
+                      milliseconds(percentile(end_to_end, 99)), milliseconds(end_to_end.last), milliseconds(percentile(on_device, 99)))
+    end
+    lines.join("\n")
+  end
+
+  # Feeds a capture written by CaptureLog.
+  def replay(path)
+    File.foreach(path) do |entry|
+      time, direction, text = entry.chomp.split(" ", 3)
+      direction == ">" ? written(text.to_s, time.to_f) : read(text.to_s, time.to_f)
+    end
+  end
+
+  private
+
+  # Device clock minus host clock, from the sync with the shortest round trip, nil without syncs.
+  def clock_offset
+    best = @clock_samples.min_by(&:first)
+    best && best.last
+  end
+
+  # States are grouped by what they show, events by their code.
+  def command_type(code)
+    if code =~ /\A\d\d([RBS])\d{4}\z/
+      "state #{$1}"
+    else
+      code[/\A[A-Z]+/] || code
+    end
+  end
+
+  # Nearest rank percentile of sorted values.
+  def percentile(sorted, rank)
+    return nil if sorted.empty?
+    sorted[((rank / 100.0) * sorted.size).ceil.clamp(1, sorted.size) - 1]
+  end
+
+  def milliseconds(value)
+    value ? format("%.1f", value) : "-"
+  end
+end
+
+# Writes everything going through a link to a file, one line per frame or answer: "<host millis> > <frame>" or "<host millis> < <line>".
+class CaptureLog
+  def initialize(path)
+    @file = File.open(path, "a")
+    @file.sync = true
+  end
+
+  def written(frame, time)
+    @file.puts(format("%.3f > %s", time, frame))
+  end
+
+  def read(line, time)
+    @file.puts(format("%.3f < %s", time, line))
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  abort("usage: ruby latency_tracer.rb capture.log [capture.log...]") if ARGV.empty?
+  tracer = LatencyTracer.new
+  ARGV.each { |path| tracer.replay(path) }
+  puts tracer.report
+end
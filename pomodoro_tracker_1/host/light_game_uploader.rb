@@ -0,0 +1,113 @@
+# Compiles light games written as text into the packed format Pomodoro Tracker 1.0 keeps in its EEPROM, and uploads them.
+#
+# A light game is a list of steps, one per line: the led pins on(2 to 7, "all" or "off") and how many milliseconds they stay that way, in
+# tens of milliseconds up to 10230. Steps between "repeat <times>" and "end" are played that many times, the ones after it once. "opaque
+# <pins>" sets which leds of the state the light game covers, all of them by default. "#" starts a comment.
+#
+#   # green leds blink 3 times, then the red one says goodbye
+#   repeat 3
+#     2 3 4   300
+#     off     300
+#   end
+#   7 1000
+#
+# Usage:
+#   ruby light_game_uploader.rb <port> <slot 0 to 3> <light game file>
+# and then "PLG<slot>-" plays it.
+require_relative "tracker_link"
+
+module LightGameUploader
+  FIRST_LED_PIN = 2
+  ALL_LEDS = 0x3F
+  SLOTS = 4
+  # slot size in the tracker minus its length and crc
+  MAX_LENGTH = 246
+  CHUNK_SIZE = 8
+
+  # Packed light game: loop steps, repetitions, final steps, opaque leds and 2 bytes per step, leds in the 6 lower bits and tens of
+  # milliseconds in the 10 upper ones.
+  def self.compile(text)
+    loop_steps = []
+    final_steps = []
+    repetitions = 1
+    opaque = ALL_LEDS
+    in_repeat = false
+    text.each_line.with_index(1) do |line, number|
+      words = line.sub(/#.*/, "").split
+      next if words.empty?
+      case words.first
+      when "repeat"
+        raise "line #{number}: only one repeat, and before any other step" if in_repeat || !loop_steps.empty? || !final_steps.empty?
+        repetitions = Integer(words[1], exception: false)
+        raise "line #{number}: repeat goes from 1 to 255 times" unless repetitions && (1..255).cover?(repetitions)
+        in_repeat = true
+      when "end"
+        raise "line #{number}: end without repeat" unless in_repeat
+        in_repeat = false
+      when "opaque"
+        opaque = leds(words[1..], number)
+      else
+        duration = Integer(words.last, exception: false)
+        raise "line #{number}: duration goes from 10 to 10230 milliseconds" unless duration && (10..10230).cover?(duration)
+        step = leds(words[0...-1], number) | ((duration + 5) / 10 << 6)
+        (in_repeat ? loop_steps : final_steps) << step
+      end
+    end
+    raise "repeat without end" if in_repeat
+    steps = loop_steps + final_steps
+    raise "no steps" if steps.empty?
+    bytes = [loop_steps.size, repetitions, final_steps.size, opaque] + steps.flat_map { |step| [step & 0xFF, step >> 8] }
+    raise "#{bytes.size} bytes, a slot takes #{MAX_LENGTH}" if bytes.size > MAX_LENGTH
+    bytes
+  end
+
+  def self.leds(words, number)
+    raise "line #{number}: which leds?" if words.empty?
+    words.map do |word|
+      case word
+      when "all" then ALL_LEDS
+      when "off" then 0
+      else
+        pin = Integer(word, exception: false)
+        raise "line #{number}: pin #{word} is not a led" unless pin && (FIRST_LED_PIN..FIRST_LED_PIN + 5).cover?(pin)
+        1 << (pin - FIRST_LED_PIN)
+      end
+    end.reduce(0) { |mask, bit| mask | bit }
+  end
+
+  # Writes the light game into a slot in checksummed chunks through the flow control of the link, so it goes at the full rate of the link and
+  # chunks that arrive broken are sent again. Returns true if the tracker found it whole.
+  def self.upload(link, slot, bytes)
+    raise "slot goes from 0 to #{SLOTS - 1}" unless (0...SLOTS).cover?(slot)
+    bytes.each_slice(CHUNK_SIZE).with_index do |chunk, index|
+      offset = index * CHUNK_SIZE
+      crc = ([slot, offset] + chunk).reduce(0) { |crc, byte| crc8(crc, byte) }
+      link.send_code(format("ULG%d%02X%s%02X", slot, offset, hex(chunk), crc))
+    end
+    link.send_code(format("ULC%d%02X%02X", slot, bytes.size, bytes.reduce(0) { |crc, byte| crc8(crc, byte) }))
+    link.flush && link.replies.include?("ULC#{slot},OK")
+  end
+
+  def self.hex(bytes)
+    bytes.map { |byte| format("%02X", byte) }.join
+  end
+
+  # CRC-8, polynomial 0x07, like the tracker.
+  def self.crc8(crc, byte)
+    crc ^= byte
+    8.times { crc = crc & 0x80 != 0 ? ((crc << 1) ^ 0x07) & 0xFF : (crc << 1) & 0xFF }
+    crc
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  abort("usage: ruby light_game_uploader.rb <port> <slot 0 to 3> <light game file>") unless ARGV.size == 3
+  port, slot, path = ARGV
+  bytes = LightGameUploader.compile(File.read(path))
+  puts "#{path}: #{bytes.size} bytes"
+  if LightGameUploader.upload(TrackerLink.new(port), Integer(slot), bytes)
+    puts "uploaded, play it with PLG#{slot}-"
+  else
+    abort("upload failed")
+  end
+end
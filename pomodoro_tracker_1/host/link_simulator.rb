@@ -0,0 +1,238 @@
+# Lossy serial line between a TrackerLink and Pomodoro Tracker 1.0, to measure how the protocol holds up on bad links(long USB cables...).
+#
+# The simulator takes the place of the IO of the link and wraps the real one. Every byte going either way can get a bit flipped, be dropped
+# or be duplicated, with the probabilities given, and every write or read is delayed by a random latency up to jitter seconds, still in order
+# like on a serial line. Observing the link too it reports:
+# * goodput: codes acknowledged per second.
+# * misdecoded: garbled frames the tracker would take as good, their checksum checks out or they have none, and garbled lines the link would
+#   take. The parser may still refuse some of them when there's no checksum, so without checksums it is an upper bound.
+# * rejected: garbled frames and lines dropped by their checksum. The tracker counts its ones in STATS.
+# * recovery: seconds from writing a code that had to be written again until it was acknowledged, median and worst, next to the ones of the
+#   codes that went through at once.
+# Seed it to repeat a run, so a change of the protocol or the parser can be compared with the same faults.
+#
+# Usage:
+#   simulator = LinkSimulator.new(File.open("/dev/ttyACM0", "r+b"), flip: 0.001, drop: 0.001, jitter: 0.002)
+#   link = TrackerLink.new(simulator)
+#   link.observe(simulator)
+# or from the command line, port being a device path or "|<command>" for a program talking the protocol over its standard IO:
+#   ruby link_simulator.rb <port> [flip=0.001] [drop=0.001] [duplicate=0.0005] [jitter=0.002] [codes=500] [checksums=on] [seed=1]
+require_relative "tracker_link"
+
+class LinkSimulator
+  DEFAULTS = {flip: 0.001, drop: 0.001, duplicate: 0.0005, jitter: 0.002}.freeze
+  # frames and lines sent, kept to tell the garbled ones apart when they arrive
+  RECENT = 512
+
+  # One way of the line: faults what is pushed into it and hands it out once its latency is over.
+  class Channel
+    attr_reader :counts
+
+    def initialize(faults, random, separator, &accepted)
+      @faults = faults
+      @random = random
+      @separator = separator
+      @accepted = accepted
+      # [due time, bytes], due times never go back so everything arrives in order
+      @queue = []
+      @last_due = 0.0
+      @sent = +""
+      @delivered = +""
+      @recent = Hash.new(0)
+      @counts = {bytes: 0, flipped: 0, dropped: 0, duplicated: 0, misdecoded: 0, rejected: 0}
+    end
+
+    def push(data, now)
+      remember(data)
+      garbled = data.each_byte.flat_map { |byte| fault(byte) }.pack("C*")
+      @last_due = [@last_due, now + @random.rand * @faults[:jitter]].max
+      @queue << [@last_due, garbled]
+    end
+
+    # Everything due by now.
+    def pop(now)
+      data = +""
+      data << @queue.shift[1] while @queue.first && @queue.first[0] <= now
+      judge(data)
+      data
+    end
+
+    private
+
+    def fault(byte)
+      @counts[:bytes] += 1
+      draw = @random.rand
+      if (draw -= @faults[:drop]) < 0
+        @counts[:dropped] += 1
+        []
+      elsif (draw -= @faults[:flip]) < 0
+        @counts[:flipped] += 1
+        [byte ^ (1 << @random.rand(8))]
+      elsif draw - @faults[:duplicate] < 0
+        @counts[:duplicated] += 1
+        [byte, byte]
+      else
+        [byte]
+      end
+    end
+
+    def remember(data)
+      @sent << data
+      while (index = @sent.index(@separator))
+        @recent[@sent.slice!(0..index).strip] += 1
+        @recent.shift if @recent.size > RECENT
+      end
+    end
+
+    # Frames that arrived as they were sent are fine, the others are misdecoded if they would be taken.
+    def judge(data)
+      @delivered << data
+      while (index = @delivered.index(@separator))
+        frame = @delivered.slice!(0..index).strip
+        next if frame.empty?
+        if @recent[frame] > 0
+          @recent[frame] -= 1
+        elsif @accepted.call(frame)
+          @counts[:misdecoded] += 1
+        else
+          @counts[:rejected] += 1
+        end
+      end
+    end
+  end
+
+  def initialize(io, seed: nil, **faults)
+    @io = io
+    faults = DEFAULTS.merge(faults)
+    random = seed ? Random.new(seed) : Random.new
+    @checksummed_frames = false
+    @checksummed_lines = false
+    # frames are judged like the tracker does, lines like TrackerLink#read_answers does
+    @to_tracker = Channel.new(faults, random, "-") do |frame|
+      !TrackerLink.verify(frame.chomp("-"), @checksummed_frames && !frame.start_with?("SEQ")).nil?
+    end
+    @to_host = Channel.new(faults, random, "\n") { |line| !TrackerLink.verify(line, @checksummed_lines).nil? }
+    @read = +""
+    # codes written and not acknowledged yet, in order, as {sequence:, written_at:, again:}
+    @outstanding = []
+    # last sequences acknowledged, a code written again after its acknowledgement is not a new one
+    @acknowledged_sequences = []
+    @first_written_at = nil
+    @last_acknowledged_at = nil
+    @acknowledged = 0
+    @clean = []
+    @recovered = []
+  end
+
+  # IO methods TrackerLink needs.
+  def write(data)
+    @checksummed_frames ||= data.include?("*")
+    @to_tracker.push(data, now)
+    deliver
+    data.size
+  end
+
+  def read_nonblock(length)
+    deliver
+    begin
+      loop do
+        data = @io.read_nonblock(256)
+        @checksummed_lines ||= data.match?(/\*[0-9A-F]{2}\r?\n/)
+        @to_host.push(data, now)
+      end
+    rescue IO::WaitReadable, EOFError
+      # nothing more for now
+    end
+    @read << @to_host.pop(now)
+    raise IO::EAGAINWaitReadable if @read.empty?
+    @read.slice!(0, length)
+  end
+
+  def sync=(value)
+    @io.sync = value
+  end
+
+  # Link observer, follows every sequenced code from its first writing to its acknowledgement.
+  def written(frame, time)
+    return unless (match = frame.match(/\A(?:@\d+:)?#(\d+):/))
+    sequence = match[1].to_i
+    @first_written_at ||= time
+    return if @acknowledged_sequences.include?(sequence)
+    if (code = @outstanding.find { |outstanding| outstanding[:sequence] == sequence })
+      code[:again] = true
+    else
+      @outstanding << {sequence: sequence, written_at: time, again: false}
+    end
+  end
+
+  def read(line, time)
+    return unless (match = line.match(/\AACK(\d+),/))
+    # acknowledgements are cumulative, repeated ones for codes already acknowledged are not found
+    index = @outstanding.index { |code| code[:sequence] == match[1].to_i } or return
+    @outstanding.shift(index + 1).each do |code|
+      (code[:again] ? @recovered : @clean) << (time - code[:written_at]) / 1000.0
+      @acknowledged += 1
+      @acknowledged_sequences << code[:sequence]
+      @acknowledged_sequences.shift if @acknowledged_sequences.size > 128
+    end
+    @last_acknowledged_at = time
+  end
+
+  def report
+    seconds = @last_acknowledged_at ? (@last_acknowledged_at - @first_written_at) / 1000.0 : 0.0
+    {to_tracker: @to_tracker.counts, to_host: @to_host.counts, acknowledged: @acknowledged, seconds: seconds,
+     goodput: seconds.zero? ? 0.0 : @acknowledged / seconds, clean: [median(@clean), @clean.max || 0.0], recovered_codes: @recovered.size,
+     recovery: [median(@recovered), @recovered.max || 0.0]}
+  end
+
+  private
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def deliver
+    data = @to_tracker.pop(now)
+    @io.write(data) unless data.empty?
+  end
+
+  def median(values)
+    values.empty? ? 0.0 : values.sort[values.size / 2]
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  port = ARGV.first or abort("usage: ruby link_simulator.rb <port|\"|command\"> [flip=] [drop=] [duplicate=] [jitter=] [codes=] [checksums=on|off] [seed=]")
+  options = ARGV.drop(1).to_h { |argument| argument.split("=", 2) }
+  faults = LinkSimulator::DEFAULTS.to_h { |name, value| [name, options.fetch(name.to_s, value).to_f] }
+  if port.start_with?("|")
+    io = IO.popen(port[1..], "r+")
+  else
+    system("stty", "-F", port, TrackerLink::BAUDS.to_s, "raw", "-echo") or abort("can't configure #{port}")
+    io = File.open(port, "r+b")
+  end
+  simulator = LinkSimulator.new(io, seed: options["seed"]&.to_i, **faults)
+  link = TrackerLink.new(simulator, checksums: options.fetch("checksums", "on") == "on")
+  link.observe(simulator)
+  # a state a second of pomodoro, with a light game now and then like the host does at the end of phases
+  options.fetch("codes", "500").to_i.times do |index|
+    link.send_code(format("%02dR%04d", index / 100 % 100, index % 1500))
+    link.send_code("MPFLG") if (index % 100).zero?
+  end
+  link.flush(120) or warn("codes left without acknowledgement")
+  report = simulator.report
+  link.send_code("STATS")
+  link.flush(5)
+  stats = link.replies.grep(/\ASTATS/).last
+  puts(format("%-24s %10.1f codes/s, %d codes in %.1f s", "goodput", report[:goodput], report[:acknowledged], report[:seconds]))
+  {"to tracker" => :to_tracker, "to host" => :to_host}.each do |name, direction|
+    counts = report[direction]
+    puts(format("%-24s %10d bytes, %d flipped, %d dropped, %d duplicated", name, *counts.values_at(:bytes, :flipped, :dropped, :duplicated)))
+    puts(format("%-24s %10d misdecoded, %d rejected", "", *counts.values_at(:misdecoded, :rejected)))
+  end
+  puts(format("%-24s %10d", "tracker bad checksums", stats.split(",")[6].to_i)) if stats&.count(",") == 6
+  puts(format("%-24s %10d", "link corrupted lines", link.corrupted_lines))
+  puts(format("%-24s %10d", "retransmissions", link.retransmissions))
+  puts(format("%-24s %10.3f s median, %.3f s worst", "clean codes", *report[:clean]))
+  puts(format("%-24s %10.3f s median, %.3f s worst, %d codes", "recovered codes", *report[:recovery], report[:recovered_codes]))
+end
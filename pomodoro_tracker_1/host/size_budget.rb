@@ -0,0 +1,76 @@
+# Flash and RAM used by Pomodoro Tracker 1.0, per function and per variable, against budgets kept next to the sketch.
+#
+# Takes the ELF the Arduino IDE or arduino-cli leaves when building(arduino-cli compile --fqbn arduino:avr:uno --output-dir build), reads it
+# with avr-nm and avr-size, and compares every symbol and the totals with size_budgets.txt, one "<flash|ram> <symbol> <bytes>" per line and
+# "<flash|ram> total <bytes>" for the totals. Symbols without a budget are only listed. cycle_budget.rb does the same for cycles.
+#
+# Usage:
+#   ruby size_budget.rb <sketch.elf>            report, exits with 1 if a budget is exceeded
+#   ruby size_budget.rb <sketch.elf> --record   writes the budgets from this build
+module SizeBudget
+  BUDGETS_PATH = File.join(__dir__, "size_budgets.txt")
+  NM = ENV.fetch("NM", "avr-nm")
+  SIZE = ENV.fetch("SIZE", "avr-size")
+  # Arduino core and libc symbols are not ours to budget
+  OWN_SYMBOL = /\A(?!_|__vector|Hardware|Serial\b|Print|Stream|String|EEPROM|millis|micros|delay|tone|noTone|digital|pin|init|main\b)/
+
+  # {"flash" => {symbol => bytes}, "ram" => {symbol => bytes}}, from the symbol table. Text symbols(t, T, w, W) are flash, data and bss ones
+  # (d, D, b, B) are RAM, read only data in flash(r, R) counts as flash.
+  def self.symbols(elf)
+    sizes = {"flash" => Hash.new(0), "ram" => Hash.new(0)}
+    `#{NM} --size-sort --print-size --demangle #{elf}`.each_line do |line|
+      _address, size, type, name = line.split(" ", 4)
+      next unless name
+      name = name.strip.sub(/\(.*\)\z/, "")
+      next unless name.match?(OWN_SYMBOL)
+      section = "tTwWrR".include?(type) ? "flash" : "ram"
+      sizes[section][name] += size.to_i(16)
+    end
+    sizes
+  end
+
+  # Flash is .text plus .data(initial values), RAM is .data plus .bss.
+  def self.totals(elf)
+    sections = `#{SIZE} -A #{elf}`.scan(/^\.(text|data|bss)\s+(\d+)/).to_h { |name, size| [name, size.to_i] }
+    {"flash" => sections.fetch("text", 0) + sections.fetch("data", 0), "ram" => sections.fetch("data", 0) + sections.fetch("bss", 0)}
+  end
+
+  def self.budgets
+    return {} unless File.exist?(BUDGETS_PATH)
+    File.readlines(BUDGETS_PATH).map(&:split).reject { |words| words.empty? || words.first.start_with?("#") }
+        .to_h { |section, name, bytes| [[section, name], bytes.to_i] }
+  end
+
+  def self.record(elf)
+    File.open(BUDGETS_PATH, "w") do |file|
+      file.puts("# <flash|ram> <symbol> <bytes>, written by size_budget.rb --record")
+      totals(elf).each { |section, bytes| file.puts("#{section} total #{bytes}") }
+      symbols(elf).each { |section, sizes| sizes.sort.each { |name, bytes| file.puts("#{section} #{name} #{bytes}") } }
+    end
+  end
+
+  # Prints every symbol with its budget, returns false if any is over it.
+  def self.report(elf)
+    budgets = self.budgets
+    within = true
+    rows = totals(elf).map { |section, bytes| [section, "total", bytes] }
+    symbols(elf).each { |section, sizes| sizes.sort_by { |_, bytes| -bytes }.each { |name, bytes| rows << [section, name, bytes] } }
+    rows.each do |section, name, bytes|
+      budget = budgets[[section, name]]
+      over = budget && bytes > budget
+      within = false if over
+      puts(format("%-5s %-40s %6d %8s%s", section, name, bytes, budget || "-", over ? "  OVER" : ""))
+    end
+    within
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  elf = ARGV.first or abort("usage: ruby size_budget.rb <sketch.elf> [--record]")
+  if ARGV.include?("--record")
+    SizeBudget.record(elf)
+    puts "budgets written to #{SizeBudget::BUDGETS_PATH}"
+  else
+    exit(SizeBudget.report(elf) ? 0 : 1)
+  end
+end
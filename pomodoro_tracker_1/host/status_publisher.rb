@@ -0,0 +1,120 @@
+# Current phase of Pomodoro Tracker 1.0 for other programs of the workstation(status bars, editors...), so they don't need the serial port.
+#
+# The publisher observes the link and takes the state codes the host writes, "16R0288" and alike. Every time the state changes it publishes a
+# snapshot in two ways:
+# * A 32 bytes shared memory file guarded by a seqlock. The sequence is odd while the snapshot is being written, readers read sequence,
+#   snapshot and sequence again, and try again if it was odd or changed. Readers never block the writer, the serial loop.
+# * A UNIX socket that answers every connection with the snapshot as a JSON line and closes it, served from its own thread.
+#
+# Snapshot layout, little endian:
+#   0  uint32 sequence
+#   4  uint8  phase, 'R' pomodoro running, 'B' break running, 'S' stopped, 0 unknown
+#   5  uint8  pomodoros completed
+#   6  uint16 phase length in seconds
+#   8  uint64 phase start, host epoch milliseconds
+#   16 uint64 published at, host epoch milliseconds
+#   24 8 bytes reserved
+# Remaining seconds are phase start + phase length - now, so nothing needs to be published while a phase goes on.
+#
+# Usage:
+#   link.observe(StatusPublisher.new)
+# and to read it:
+#   ruby status_publisher.rb [shm|socket]
+require "json"
+require "socket"
+
+class StatusPublisher
+  SHARED_MEMORY_PATH = "/dev/shm/pomodoro_tracker_status"
+  SOCKET_PATH = File.join(ENV.fetch("XDG_RUNTIME_DIR", "/tmp"), "pomodoro_tracker.sock")
+  SNAPSHOT_SIZE = 32
+  PAYLOAD_FORMAT = "CCvQ<Q<x8"
+  POMODORO_LENGTH = 1500
+  SHORT_BREAK_LENGTH = 300
+  LONG_BREAK_LENGTH = 900
+
+  def initialize(shared_memory_path = SHARED_MEMORY_PATH, socket_path = SOCKET_PATH)
+    @shared_memory = File.open(shared_memory_path, File::RDWR | File::CREAT, 0o644)
+    @shared_memory.truncate(SNAPSHOT_SIZE)
+    @sequence = 0
+    @snapshot = {phase: nil, pomodoros: 0, phase_length: 0, phase_start: 0, published_at: 0}.freeze
+    write_snapshot
+    File.delete(socket_path) if File.socket?(socket_path)
+    @server = UNIXServer.new(socket_path)
+    @server_thread = Thread.new { serve }
+  end
+
+  # Link observer, state codes written to the tracker are published.
+  def written(frame, time)
+    # the state is the whole code, after the trace and sequence if any, so hex data ending like one is not taken
+    return unless (match = frame.match(/(?:\A|:)(\d\d)([RBS])(\d{4})\z/))
+    pomodoros, phase, seconds = match[1].to_i, match[2], match[3].to_i
+    phase_length = case phase
+                   when "R" then POMODORO_LENGTH
+                   when "B" then (pomodoros % 4).zero? ? LONG_BREAK_LENGTH : SHORT_BREAK_LENGTH
+                   else 0
+                   end
+    # a new state every second of the same phase changes nothing
+    phase_start = (time - seconds * 1000).round
+    return if phase == @snapshot[:phase] && pomodoros == @snapshot[:pomodoros] && (phase_start - @snapshot[:phase_start]).abs < 2000
+    # a frozen hash swapped in one assignment, the socket thread sees the old one or the new one
+    @snapshot = {phase: phase, pomodoros: pomodoros, phase_length: phase_length, phase_start: phase_start, published_at: time.round}.freeze
+    write_snapshot
+  end
+
+  # Answers from the tracker don't change the status.
+  def read(line, time)
+  end
+
+  # Reads the shared memory snapshot like any reader should, retrying while it is being written.
+  def self.read_shared_memory(path = SHARED_MEMORY_PATH)
+    File.open(path, "rb") do |file|
+      loop do
+        sequence = file.pread(4, 0).unpack1("V")
+        next if sequence.odd?
+        payload = file.pread(SNAPSHOT_SIZE - 4, 4)
+        next unless file.pread(4, 0).unpack1("V") == sequence
+        phase, pomodoros, phase_length, phase_start, published_at = payload.unpack(PAYLOAD_FORMAT)
+        return snapshot_hash(phase.zero? ? nil : phase.chr, pomodoros, phase_length, phase_start, published_at)
+      end
+    end
+  end
+
+  # Asks the socket for the snapshot.
+  def self.read_socket(path = SOCKET_PATH)
+    UNIXSocket.open(path) { |socket| JSON.parse(socket.gets, symbolize_names: true) }
+  end
+
+  def self.snapshot_hash(phase, pomodoros, phase_length, phase_start, published_at)
+    remaining = phase_length.zero? ? 0 : [(phase_start + phase_length * 1000 - Time.now.to_f * 1000) / 1000, 0].max.round
+    {phase: phase, pomodoros: pomodoros, phase_length: phase_length, phase_start: phase_start, published_at: published_at,
+     remaining: remaining}
+  end
+
+  private
+
+  def write_snapshot
+    snapshot = @snapshot
+    payload = [snapshot[:phase] ? snapshot[:phase].ord : 0, *snapshot.values_at(:pomodoros, :phase_length, :phase_start, :published_at)]
+    @shared_memory.pwrite([@sequence += 1].pack("V"), 0)
+    @shared_memory.pwrite(payload.pack(PAYLOAD_FORMAT), 4)
+    @shared_memory.pwrite([@sequence += 1].pack("V"), 0)
+  end
+
+  def serve
+    loop do
+      client = @server.accept
+      snapshot = @snapshot
+      client.puts(JSON.generate(self.class.snapshot_hash(*snapshot.values_at(:phase, :pomodoros, :phase_length, :phase_start,
+                                                                             :published_at))))
+    rescue Errno::EPIPE, Errno::ECONNRESET
+      # the reader left already
+    ensure
+      client&.close
+    end
+  end
+end
+
+if $PROGRAM_NAME == __FILE__
+  snapshot = ARGV.first == "socket" ? StatusPublisher.read_socket : StatusPublisher.read_shared_memory
+  puts JSON.generate(snapshot)
+end
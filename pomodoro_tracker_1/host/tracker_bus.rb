@@ -0,0 +1,191 @@
+# Several Pomodoro Tracker 1.0 on one serial line(TX shared through diodes), each with its own TrackerLink.
+#
+# Every tracker has an address saved in its EEPROM with "ADRXX". Frames for a tracker go as ">XX<frame>-" and the others skip them as soon as
+# they read the address, lines from a tracker come as ">XX<line>". The bus hands out a port per address that adds and takes away the
+# address, so a TrackerLink on it works as if it had the line for itself. Broadcast codes go to every tracker and are never answered, so only
+# codes that need no answer, like light games or sounds, go that way.
+#
+# Trackers only talk when answering, so the bus lets a single tracker have frames without answer: the others' frames wait until it answered
+# them all and stayed quiet for a moment, or its answers were lost. That way two trackers never talk at the same time.
+#
+# Checksums cover the address, a garbled one would take a frame or its answer to another tracker. The bus makes the checksums of the frames
+# again with the address in front, and checks every line whole before sorting it, the link gets it with a checksum of its own.
+#
+# Usage:
+#   bus = TrackerBus.new("/dev/ttyUSB0")
+#   desk = TrackerLink.new(bus.port(0x01))
+#   shelf = TrackerLink.new(bus.port(0x02))
+#   bus.broadcast("MSOLG")
+#   desk.send_code("16R0288")
+#   [desk, shelf].each(&:flush)
+class TrackerBus
+  BROADCAST = 0xFF
+  # seconds the line stays with a tracker after its last answer, for lines it sends after answering, like traces
+  QUIET_TIME = 0.02
+  # seconds a tracker keeps the line without a word, its answers were lost then
+  ANSWER_TIMEOUT = TrackerLink::RETRANSMIT_TIMEOUT
+
+  # What a tracker sees of the bus, with the IO methods TrackerLink needs.
+  class Port
+    attr_reader :address
+
+    def initialize(bus, address)
+      @bus = bus
+      @address = address
+    end
+
+    def write(data)
+      @bus.write(@address, data)
+    end
+
+    # Lines the bus read for this address. Raises like an IO with nothing to read.
+    def read_nonblock(length)
+      @bus.read_lines
+      data = @bus.take(@address, length)
+      raise IO::EAGAINWaitReadable if data.empty?
+      data
+    end
+
+    def sync=(value)
+    end
+
+    # Bytes the bus puts in front of every frame, ">XX". They go through the receive ring of the tracker like the frame, so the link
+    # counts them against its credits.
+    def frame_overhead
+      3
+    end
+  end
+
+  # Lines that came without address, from trackers that still have none, or not for a port of ours.
+  attr_reader :unaddressed
+  # Addressed lines dropped because their checksum didn't check out, they never reach a link.
+  attr_reader :corrupted_lines
+
+  # port can be a device path or an already open IO.
+  def initialize(port, bauds = TrackerLink::BAUDS)
+    if port.is_a?(String)
+      system("stty", "-F", port, bauds.to_s, "raw", "-echo") or raise "can't configure #{port}"
+      port = File.open(port, "r+b")
+    end
+    @io = port
+    @io.sync = true
+    @line = +""
+    @received = Hash.new { |received, address| received[address] = +"" }
+    @unaddressed = []
+    @corrupted_lines = 0
+    # tracker with the line, the answers it still owes, :sequenced for an ACK or NAK or the code a plain frame is answered with, and when it
+    # was last heard of
+    @talking = nil
+    @unanswered = []
+    @heard_at = 0.0
+    # what the other ports wrote, by address in the order they asked for the line
+    @waiting = {}
+  end
+
+  def port(address)
+    raise ArgumentError, "address #{address} out of 0..254" unless (0...BROADCAST).cover?(address)
+    Port.new(self, address)
+  end
+
+  # Writes a code for every tracker, out of the flow control since nobody answers it. With a checksum like the links write them, trackers
+  # that got one drop frames without it.
+  def broadcast(code)
+    write_frames(BROADCAST, "#{code}*#{TrackerLink.checksum(code)}-")
+  end
+
+  # Data written by a port, it waits while another tracker has the line. A port with the line waits too once others are waiting, so none
+  # keeps it for ever.
+  def write(address, data)
+    release
+    if @talking.nil? || (@talking == address && @waiting.empty?)
+      talk(address, data)
+    else
+      (@waiting[address] ||= +"") << data
+    end
+  end
+
+  # Reads what there is and sorts the lines by address.
+  def read_lines
+    loop do
+      @line << @io.read_nonblock(256)
+    rescue IO::WaitReadable, EOFError
+      break
+    end
+    while (index = @line.index("\n"))
+      line = @line.slice!(0..index).strip
+      next if line.empty?
+      unless line.start_with?(">")
+        @unaddressed << line
+        next
+      end
+      checked = TrackerLink.verify(line)
+      match = checked&.match(/\A>([0-9A-F]{2})/)
+      if match.nil?
+        @corrupted_lines += 1
+        next
+      end
+      address = match[1].to_i(16)
+      text = match.post_match
+      answered(text) if address == @talking
+      # the link gets the line as it would come on a line of its own, lines of older trackers come without checksum
+      text = "#{text}*#{TrackerLink.checksum(text)}" unless checked == line
+      @received[address] << text << "\n"
+    end
+    release
+  end
+
+  def take(address, length)
+    @received[address].slice!(0, length)
+  end
+
+  private
+
+  def talk(address, data)
+    @talking = address
+    @heard_at = now
+    data.split(/(?<=-)/).each do |frame|
+      code = frame.sub(/\A@\d+:/, "")
+      @unanswered << (code.start_with?("#") ? :sequenced : code[0, 3])
+    end
+    write_frames(address, data)
+  end
+
+  # Frames are written whole, so the address is put in front of each one and their checksum made again to cover it.
+  def write_frames(address, data)
+    @io.write(data.split(/(?<=-)/).map { |frame| addressed(address, frame) }.join)
+  end
+
+  def addressed(address, frame)
+    frame = format(">%02X%s", address, frame)
+    match = frame.match(/\*[0-9A-F]{2}-\z/) or return frame
+    "#{match.pre_match}*#{TrackerLink.checksum(match.pre_match)}-"
+  end
+
+  # Answers come in the order of the frames, but replies and traces go in between.
+  def answered(line)
+    @heard_at = now
+    index = if line.start_with?("ACK", "NAK")
+              @unanswered.index(:sequenced)
+            else
+              @unanswered.index { |answer| answer != :sequenced && line.start_with?(answer) }
+            end
+    @unanswered.delete_at(index) if index
+  end
+
+  # The line goes to the port waiting the longest.
+  def release
+    return if @talking.nil?
+    quiet = now - @heard_at
+    return unless (@unanswered.empty? && quiet >= QUIET_TIME) || quiet >= ANSWER_TIMEOUT
+    @talking = nil
+    @unanswered.clear
+    address, data = @waiting.first
+    return if address.nil?
+    @waiting.delete(address)
+    talk(address, data)
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+end
@@ -0,0 +1,248 @@
+# Serial link to Pomodoro Tracker 1.0 with credit based flow control.
+#
+# Every code goes as "#<sequence>:<code>-". The tracker answers "ACK<sequence>,<bytes free>,<light game slots free>" once it is done with
+# it, or "NAK<sequence>,<sequence expected>,<bytes free>,<light game slots free>" when a code in between was lost or a light game didn't fit
+# in its queue. Codes are only written while they fit in the credits advertised by the tracker, and the ones not acknowledged in time are
+# written again, in order, from the first one missing.
+#
+# Codes can carry a trace, "@<trace>:" in front of the frame, so the tracker reports when it read, dispatched and showed them. Observers added
+# with observe get every frame written and every line read, with its time, see latency_tracer.rb.
+#
+# Frames go with a checksum, "*<CRC-8 in hex>" before the '-', and the lines of the tracker come with one too. Garbled lines are dropped and
+# counted, what they answered is asked again like for a lost line. Lines without checksum are taken until the first one with it arrives, so
+# older trackers still work. Observers get frames and lines without checksum.
+#
+# After starting again, query_state tells what the tracker is showing, so only what differs needs to be sent.
+#
+# Usage:
+#   link = TrackerLink.new("/dev/ttyACM0")
+#   link.query_state
+#   link.send_code("16R0288")
+#   link.send_code("MPFLG", trace: 1)
+#   link.flush
+class TrackerLink
+  BAUDS = 115200
+  # receive ring and light game queue of the tracker, used until the first answer arrives
+  RX_BUFFER_SIZE = 128
+  LIGHT_GAME_SLOTS = 4
+  # seconds without acknowledgement before writing a code again
+  RETRANSMIT_TIMEOUT = 0.5
+
+  # Lines from the tracker that are not flow control, like CLK or STATS answers.
+  attr_reader :replies
+  # Codes written again, to see how lossy the link is.
+  attr_reader :retransmissions
+  # Lines dropped because their checksum didn't check out.
+  attr_reader :corrupted_lines
+
+  # port can be a device path or an already open IO. Without checksums frames go as older trackers expect them.
+  def initialize(port, bauds = BAUDS, checksums: true)
+    if port.is_a?(String)
+      system("stty", "-F", port, bauds.to_s, "raw", "-echo") or raise "can't configure #{port}"
+      port = File.open(port, "r+b")
+    end
+    @io = port
+    @io.sync = true
+    # bytes the port adds to every frame, like the address of a TrackerBus
+    @frame_overhead = port.respond_to?(:frame_overhead) ? port.frame_overhead : 0
+    @next_sequence = 0
+    # sequence of the first code never written
+    @unwritten_sequence = 0
+    # codes waiting for credits, in order, as [sequence, code]
+    @pending = []
+    # codes written and not acknowledged yet, sequence => {code:, sent_at:}
+    @in_flight = {}
+    @byte_credits = RX_BUFFER_SIZE - 1
+    @game_credits = LIGHT_GAME_SLOTS
+    @last_rewind_at = Time.at(0)
+    @line = +""
+    @replies = []
+    @retransmissions = 0
+    @checksums = checksums
+    @line_checksums = false
+    @corrupted_lines = 0
+    @synchronized = false
+    @observers = []
+  end
+
+  # Queues a code, it is written as soon as the tracker has room for it. trace goes from 0 to 65535.
+  def send_code(code, trace: nil)
+    @pending << [@next_sequence, code, trace]
+    @next_sequence = (@next_sequence + 1) & 0xFF
+    pump
+  end
+
+  # Writes a clock sync right now, out of the flow control, so the host time in it is the real writing time.
+  def sync_clock
+    write_frame("CLK#{(Time.now.to_f * 1000).round}")
+  end
+
+  # Asks the tracker what it is showing and waits for the answer, out of the flow control. Returns {protocol:, state:, leds:, game:, alert:,
+  # queued:, expected_sequence:}, light games nil for idle layers, or nil if there was no answer(switch off, or the answer was lost).
+  def query_state(timeout = RETRANSMIT_TIMEOUT)
+    write_frame("QST")
+    limit = Time.now + timeout
+    until (reply = @replies.find { |line| line.start_with?("QST") })
+      return nil if Time.now > limit
+      read_answers
+      sleep(0.005)
+    end
+    @replies.delete(reply)
+    protocol, state, leds, game, alert, queued, expected_sequence = reply.delete_prefix("QST").split(",")
+    {protocol: protocol.to_i, state: state, leds: leds.to_i(16), game: game == "-" ? nil : game.to_i(16),
+     alert: alert == "-" ? nil : alert.to_i(16), queued: queued.to_i, expected_sequence: expected_sequence.to_i}
+  end
+
+  # observer.written(frame, time) and observer.read(line, time) are called for everything going through the link, times in epoch
+  # milliseconds.
+  def observe(observer)
+    @observers << observer
+  end
+
+  # Keeps the link going: reads answers, writes again what timed out and writes what fits. Call it often.
+  def pump
+    read_answers
+    synchronize unless @synchronized
+    return unless @synchronized
+    now = Time.now
+    # oldest code not acknowledged in time, everything from it goes again
+    timed_out = @in_flight.select { |_, frame| now - frame[:sent_at] > RETRANSMIT_TIMEOUT }.keys.max_by { |sequence| age(sequence) }
+    rewind(timed_out) if timed_out
+    while (sequence, code, trace = @pending.first)
+      unless fits?(code, trace)
+        # nothing in flight means no answer is coming to bring new credits, ask for them
+        @synchronized = false if @in_flight.empty?
+        break
+      end
+      @pending.shift
+      write_frame("#{"@#{trace}:" if trace}##{sequence}:#{code}")
+      @in_flight[sequence] = {code: code, trace: trace, sent_at: Time.now}
+      @unwritten_sequence = (sequence + 1) & 0xFF if sequence == @unwritten_sequence
+    end
+  end
+
+  # Pumps until every code has been acknowledged, or the timeout is reached. Returns true if everything went through.
+  def flush(timeout = 30)
+    limit = Time.now + timeout
+    until @pending.empty? && @in_flight.empty?
+      return false if Time.now > limit
+      pump
+      sleep(0.005)
+    end
+    true
+  end
+
+  # CRC-8(polynomial 0x07) of the text in 2 hex digits, like the tracker computes it.
+  def self.checksum(text)
+    crc = text.each_byte.reduce(0) do |value, byte|
+      value ^= byte
+      8.times { value = value & 0x80 != 0 ? ((value << 1) ^ 0x07) & 0xFF : (value << 1) & 0xFF }
+      value
+    end
+    format("%02X", crc)
+  end
+
+  # The line without its checksum, nil if it is garbled.
+  def self.verify(line, required = false)
+    match = line.match(/\*([0-9A-F]{2})\z/) or return required ? nil : line
+    match[1] == checksum(match.pre_match) ? match.pre_match : nil
+  end
+
+  private
+
+  # Tells the tracker where our sequence starts, until it answers nothing else is written.
+  def synchronize
+    if @synchronize_sent_at.nil? || Time.now - @synchronize_sent_at > RETRANSMIT_TIMEOUT
+      write_frame("SEQ#{first_sequence}")
+      @synchronize_sent_at = Time.now
+    end
+  end
+
+  def first_sequence
+    (@pending.first || [@next_sequence]).first
+  end
+
+  # A code fits if its bytes and, for light games, its slot are not taken by the codes already in flight.
+  def fits?(code, trace)
+    bytes_in_flight = @in_flight.values.sum { |frame| frame_length(frame[:code], frame[:trace]) }
+    return false if bytes_in_flight + frame_length(code, trace) > @byte_credits
+    return true unless light_game?(code)
+    @in_flight.values.count { |frame| light_game?(frame[:code]) } < @game_credits
+  end
+
+  # Longest the frame can be, whatever its sequence, with what the port adds to it.
+  def frame_length(code, trace)
+    "#{"@#{trace}:" if trace}#255:#{code}#{"*00" if @checksums}-".length + @frame_overhead
+  end
+
+  def light_game?(code)
+    code.end_with?("FLG") || code.start_with?("PLG")
+  end
+
+  # How many codes ago the sequence was written. Counted from the codes written, not the ones queued, those can be more than the sequences.
+  def age(sequence)
+    (@unwritten_sequence - sequence) & 0xFF
+  end
+
+  # Puts every code in flight from the sequence onwards back in front of the pending ones, in order.
+  def rewind(sequence)
+    again = @in_flight.keys.select { |in_flight| age(in_flight) <= age(sequence) }.sort_by { |in_flight| -age(in_flight) }
+    @pending.unshift(*again.map { |in_flight| [in_flight, *@in_flight.delete(in_flight).values_at(:code, :trace)] })
+    @retransmissions += again.size
+    @last_rewind_at = Time.now
+  end
+
+  def write_frame(frame)
+    @io.write(@checksums ? "#{frame}*#{TrackerLink.checksum(frame)}-" : "#{frame}-")
+    time = Time.now.to_f * 1000
+    @observers.each { |observer| observer.written(frame, time) }
+  end
+
+  def read_answers
+    loop do
+      @line << @io.read_nonblock(256)
+    rescue IO::WaitReadable, EOFError
+      break
+    end
+    time = Time.now.to_f * 1000
+    while (index = @line.index("\n"))
+      line = @line.slice!(0..index).strip
+      next if line.empty?
+      checked = TrackerLink.verify(line, @line_checksums)
+      if checked.nil?
+        @corrupted_lines += 1
+        next
+      end
+      # once the tracker sends checksums a line without one is a garbled one
+      @line_checksums ||= checked != line
+      line = checked
+      @observers.each { |observer| observer.read(line, time) }
+      answer(line)
+    end
+  end
+
+  def answer(line)
+    case line
+    when /\AACK(\d+),(\d+),(\d+)\z/
+      # codes are done in order, so everything written before it is done too
+      acknowledged = age($1.to_i)
+      @in_flight.delete_if { |sequence, _| age(sequence) >= acknowledged }
+      credits($2, $3)
+    when /\ANAK(\d+),(\d+),(\d+),(\d+)\z/
+      rejected = @in_flight[$1.to_i]
+      credits($3, $4)
+      # NAKs for codes written before the last rewind are already being taken care of
+      rewind($2.to_i) if rejected && rejected[:sent_at] > @last_rewind_at && @in_flight.key?($2.to_i)
+    when /\ASEQ(\d+),(\d+),(\d+)\z/
+      @synchronized = true
+      credits($2, $3)
+    else
+      @replies << line
+    end
+  end
+
+  def credits(bytes, games)
+    @byte_credits = bytes.to_i
+    @game_credits = games.to_i
+  end
+end
@@ -30,6 +30,20 @@ Pins used
 * 8 = INPUT, switch
 * 12 = OUTPUT, buzzer
 
+Led bank
+========
+Defining CHARLIEPLEXED_LEDS pins 2 to 7 drive 30 leds charlieplexed instead of 6: 25 green leds for the minutes of the pomodoro, 2 blue and 1
+red, 2 left. Led n goes from the pin of row n / 5(anode) to the other pins of the row in order(cathodes), see ledBankCathodePins. Timer 1
+lights a row at a time, 1200 rows per second so the whole bank 200 times. Light games still use the 6 leds, a green one lights a third of
+the minutes.
+
+Profiling
+=========
+Defining PATH_PROFILING timer 1 counts every CPU cycle, and the main code paths are timed with it: inspectSerialPortInput(),
+showPomodoroRunning(), showBreakRunning(), showSystemStopped() and composeLeds(). Interrupts that come in the middle are counted too, it is
+what the path takes on the device. Timer 1 drives the led bank, so it can't be defined together with CHARLIEPLEXED_LEDS.
+host/cycle_budget.rb reads the counts and compares them with budgets.
+
 Changes vs. version 0.1
 =======================
 * Software built with Ruby now replaces many functions that the Arduino have been doing by itself.
@@ -38,13 +52,74 @@ Changes vs. version 0.1
 * Now the switch that defines if Arduino is active has become the only input from the Arduino itself. If it is not active all leds are off and remains hanging.
 * The system must not flush the serial port by itself, only if the switch is censused "on".
 * The system can read an event or a state. The state can be pomodor running, break running or stopped. The events are any light game or sounds.
+* Leds are composed in layers: the state sets the base layer, light games are overlays played on top of it without delays. When a light game
+  finishes the state shows again right away, and states received in the meantime are not lost.
+
+Serial codes
+============
+At SERIAL_BAUDS(115200), 8 data bits, no parity, 1 stop bit. Every code ends with '-'.
+* States, 7 characters, kind of "16R0288": pomodoros completed(2 digits), state(R = pomodoro running, B = break running, S = stopped), seconds since
+  beggining of actual phase(4 digits).
+* Events: MSOLG, MPFLG, MPN12FLG, MPN22FLG, MBFLG(light games), SSB, SHB(sounds).
+* Statistics: "STATS", answered with "STATS<codes processed>,<codes in last pass>,<most codes in a pass>,<bytes dropped>,<passes with full
+  receive buffer>,<frames for other trackers>,<frames with a bad checksum>". "UST" answered with "UST<bytes lost by the
+  USART(overruns)>,<bytes lost with the receive ring full>,<framing errors>,<most bytes in the receive ring>,<most bytes in the transmit
+  ring>,<bytes not sent with the transmit ring full>,<replies not sent for lack of room>".
+* Flow control: any code can go as "#<sequence>:<code>", sequence from 0 to 255 and wrapping. Sequenced codes are taken in order and answered
+  with "ACK<sequence>,<receive buffer bytes free>,<light game slots free>" once done. A code out of order, or a light game that doesn't fit in
+  the queue, is answered with "NAK<sequence>,<sequence expected>,<receive buffer bytes free>,<light game slots free>" and the host has to send
+  again from the expected one. Unknown or broken codes are acknowledged and dropped, sending them again would get the same. Repeated codes are
+  acknowledged again but not done twice. "SEQ<sequence>" sets the next sequence expected and is
+  answered with "SEQ<sequence>,<receive buffer bytes free>,<light game slots free>", the host does it on connection.
+* Checksums: any frame can end with "*XX", XX in hex the CRC-8(polynomial 0x07) of the frame before the '*', address included, so
+  "#12:16R0288*XX-". A frame whose checksum doesn't check out is dropped without answer, sequenced ones are sent again by the host. Frames
+  without checksum are taken from hosts that don't send them: once a frame with checksum came they are dropped too, until a "SEQ" without
+  it. Every line the device sends ends with "*XX" before the line end, the CRC-8 of the line with its address, so the host can drop garbled
+  ones too. A garbled address would take a frame, or its answer, to another tracker. States must be digits but for the state letter,
+  anything else is refused. host/link_simulator.rb measures how the protocol copes with a garbled line.
+* Tracing: any code, sequenced or not, can start with "@<trace>:", trace from 0 to 65535. Once the leds have been written after doing it
+  the device answers "TRC<trace>,<device millis when read>,<microseconds until dispatched>,<microseconds until leds written>". Read means the
+  first char of the code taken out of the receive buffer.
+* Uploaded light games: "ULG<slot><offset><data><crc>" writes up to 8 bytes of a light game in one of the 4 EEPROM slots, "ULC<slot><length>
+  <crc>" checks the whole light game and answers "ULC<slot>,OK" or "ULC<slot>,BAD"(the slot is left empty), "PLG<slot>" plays it like any
+  other light game. Offset, length, data and crcs go in hex, 2 digits per byte, chunk crc covers slot, offset and data.
+  host/light_game_uploader.rb writes them.
+* Addresses: several trackers can share one serial line. A frame starting with ">XX", XX the address in hex, is only taken by the tracker with
+  that address, or by all of them if it is FF(broadcast). Frames without address are taken by any tracker. A tracker with an address starts
+  every line it sends with ">XX". Trackers only talk when answering, broadcast frames are never answered(don't send them sequenced) and the
+  host waits for a tracker to answer before writing to another one, so trackers don't talk over each other. "ADRXX" saves the address in the
+  EEPROM, FF removes it, answered with "ADRXX" still with the old address. Send it with a single tracker on the line.
+* Energy: "NRG", answered with "NRG<device millis>,<buzzer millis>,<millis on of each led, 6 values>", and "NRG<source>" answered with
+  "NRG<source>,<millis shown>,<led millis>", a led millis being a led on for a millisecond. Sources go from 0 to 11: stopped(switch off
+  too), pomodoro and break, then the 5 built in light games and the 4 uploaded slots, what is shown is the light game on top if any.
+  Counters wrap after 49.7 days, host/energy_report.rb turns them into mAh.
+* State query: "QST", answered with "QST<protocol version>,<state as the host sends it>,<leds shown>,<light game of the game layer>,<light
+  game of the alert layer>,<light games queued>,<sequence expected>", leds in hex(bit 0 pin 2), light games in hex or '-' if the layer is idle.
+  So a host that starts again knows what is shown in one round trip, and only sends what differs. Not answered with the switch off.
+* Led bank: "CPX", only with CHARLIEPLEXED_LEDS, answered with "CPX<interrupts>,<timer ticks in them>,<most ticks in one>", a tick is half a
+  microsecond and a row lasts 1666, so the interrupt CPU share is ticks / (interrupts * 1666).
+* Profiling: "PRF", only with PATH_PROFILING, answered with "PRF<paths>,<cycles the measure itself takes>", "PRF<path>" with "PRF<path>,
+  <runs>,<cycles>,<most cycles in a run>". Paths in the order of Profiling up above, cycles with the measure taken away.
+* Flight recorder: the device keeps its last FLIGHT_RECORDER_SIZE(32) events in RAM. "FLR" is answered with "FLR<device millis>,<host millis,
+  '-' if never synced>,<records so far>", "FLR<record>" with "FLR<record>,<record>..." up to 4 records from that one on, the ones still kept.
+  A record is 6 hex digits with the low 24 bits of the device millis, a letter for what happened and 2 hex bytes about it: C code
+  taken(CRC-8 of the code, sequence or FF), X code refused(same), K frame dropped by its checksum(CRC-8 of it or 0 without checksum,
+  length), P phase shown(R, B or S, pomodoros completed), G and E light game started and ended(layer, light game), W switch(1 on or 0 off,
+  0). FLR codes are not recorded. host/flight_recorder.rb dumps it and merges it with what the host wrote and read.
+* Clock sync: "CLK<host millis>", answered with "CLK<host millis>,<device receive millis>,<device reply millis>" so the host can compute offset and
+  round trip like NTP does. The device uses it to estimate the host clock offset and drift, and advances the pomodoro leds by itself.
 */
 
 // include aliases of sounds as frecuencies
 #include "pitches.h"
+// uploaded light games and the address are kept in the EEPROM
+#include <EEPROM.h>
 
 /* Function prototypes */
 void checkSwitch(void);
+void flushSerialInput(void);
+void reportState(void);
+void printDigits(unsigned long value, byte digits);
 void makeSystemOnLightGame(void);
 void soundSadBuzzer(void);
 void soundHappyBuzzer(void);
@@ -54,10 +129,51 @@ void makePomodoroN22FinishedLightGame(void);
 void makeBreakFinishedLightGame(void);
 void resetEverything(void);
 void inspectSerialPortInput(void);
+void handleFrame(char* frame);
+boolean interpretCode(String code);
+void reportCredits(void);
+void traceFrame(unsigned int trace);
+void reportTraces(void);
+byte lightGameSlotsFree(void);
+void reportSerialStatistics(void);
+void reportUartStatistics(void);
 boolean isCodeAnEvent(String);
 void showPomodoroRunning(long secondsSincePomodoroStart);
 void showBreakRunning(long pomodorosCompleted);
 void showSystemStopped(void);
+void synchronizeClock(String hostTimeCode);
+unsigned long long deviceClock(void);
+unsigned long long hostClock(void);
+unsigned long long parseClock(String digits);
+void printClock(unsigned long long time);
+void updateLocalSchedule(void);
+boolean playLightGame(byte layer, byte lightGame);
+void queueLightGame(byte lightGame);
+void readLightGameStep(struct OverlayLayer* overlay, byte* leds, unsigned int* duration);
+void advanceOverlayLayer(byte layer);
+boolean uploadLightGameChunk(const char* code);
+boolean checkUploadedLightGame(const char* code);
+int hexByte(const char* code, unsigned int position);
+int hexDigit(char hex);
+boolean beginReply(byte length);
+void endReply(void);
+void printHexByte(byte value);
+byte crc8(byte crc, byte data);
+void composeLeds(void);
+void showOnLedBank(byte leds);
+void reportLedBank(void);
+unsigned long profileClock(void);
+void profilePath(byte path, unsigned long start);
+boolean reportPathProfile(const char* code);
+byte energySource(void);
+void accountEnergy(void);
+void reportEnergy(String code);
+boolean takeCode(const char* code, int sequence);
+boolean codeFits(const char* code);
+struct FlightRecord* recordFlight(char kind, byte high, byte low);
+void reportFlightRecorder(String code);
+void playMelody(const struct Melody* melody);
+void advanceMelody(void);
 /* Deprecated function prototypes
 void checkButton(void);
 void startPomodoro(void);
@@ -69,27 +185,411 @@ void checkCurrentBreak(void);
 void finishBreak(void); 
 */
 
+// serial port speed, also used to know how long a code takes to arrive. Double speed mode makes the USART good up to 1000000, rates
+// dividing 2000000 exactly(250000, 500000) have no error at all
+#define SERIAL_BAUDS 115200
+// answered to "QST", goes up when codes change meaning
+#define PROTOCOL_VERSION 1
+// longest code accepted, '-' not included. Longer ones are dropped
+#define CODE_BUFFER_SIZE 40
+// traced codes waiting for their leds to be written
+#define TRACE_SLOTS 4
+// address of this tracker on a shared serial line, in the EEPROM. BROADCAST_ADDRESS is every tracker, and as our address means we have none
+#define DEVICE_ADDRESS_ADDRESS 0
+#define BROADCAST_ADDRESS 0xFF
+// work done with the serial port in a single loop pass, codes already received are interpreted until one of the limits is reached
+#define SERIAL_BUDGET_MICROS 4000
+#define SERIAL_BUDGET_CODES 8
+// rings of the serial port, powers of 2 up to 256. The receive ring has to hold what arrives while the loop is busy, the transmit ring the
+// replies of a loop pass
+#define UART_RX_RING_SIZE 128
+#define UART_TX_RING_SIZE 128
+// lengths given to beginReply() by the longest reply, "NRG" with the totals, and by the ACK/NAK of a sequenced code. Every line takes
+// REPLY_FRAMING more: address, checksum and their separators
+#define ENERGY_REPLY_LENGTH (3 + 12 + 7 * 11 + 2)
+#define ACK_REPLY_LENGTH 18
+#define REPLY_FRAMING 6
+// codes are only taken while the transmit ring has room for the longest reply and its ACK, the ones left wait in the receive ring
+#define UART_REPLY_ROOM (ENERGY_REPLY_LENGTH + REPLY_FRAMING + ACK_REPLY_LENGTH + REPLY_FRAMING)
+// events kept by the flight recorder, a power of 2, 6 bytes each. And how many go in a "FLR<record>" answer
+#define FLIGHT_RECORDER_SIZE 32
+#define FLIGHT_RECORDS_PER_REPLY 4
+// what a flight record tells, see Flight recorder up above for the 2 bytes each one carries
+#define FLIGHT_CODE 'C'
+#define FLIGHT_REFUSED 'X'
+#define FLIGHT_BAD_FRAME 'K'
+#define FLIGHT_PHASE 'P'
+#define FLIGHT_GAME_START 'G'
+#define FLIGHT_GAME_END 'E'
+#define FLIGHT_SWITCH 'W'
+
+/* UART */
+// Serial port straight over the USART, in place of HardwareSerial. The receive interrupt fills the receive ring and the loop empties it, the
+// loop fills the transmit ring and the data register empty interrupt empties it. Every index is written by one side only, and is a byte, so
+// neither side ever waits for the other. Writing never waits either, what doesn't fit in the transmit ring is dropped and counted.
+class UartPort : public Stream {
+  public:
+    void begin(unsigned long bauds);
+    virtual int available(void);
+    virtual int read(void);
+    virtual int peek(void);
+    virtual int availableForWrite(void);
+    virtual size_t write(uint8_t data);
+    virtual void flush(void);
+    using Print::write;
+};
+
+static_assert(UART_RX_RING_SIZE <= 256 && (UART_RX_RING_SIZE & (UART_RX_RING_SIZE - 1)) == 0, "receive ring must be a power of 2 up to 256");
+static_assert(UART_TX_RING_SIZE <= 256 && (UART_TX_RING_SIZE & (UART_TX_RING_SIZE - 1)) == 0, "transmit ring must be a power of 2 up to 256");
+static_assert(UART_REPLY_ROOM < UART_TX_RING_SIZE, "transmit ring must hold the longest reply and its ACK, a byte of it is always free");
+volatile byte uartRxRing[UART_RX_RING_SIZE];
+volatile byte uartRxHead = 0;
+volatile byte uartRxTail = 0;
+volatile byte uartTxRing[UART_TX_RING_SIZE];
+volatile byte uartTxHead = 0;
+volatile byte uartTxTail = 0;
+// what went wrong, counted by the interrupts except the transmit ones
+volatile unsigned long uartRxOverruns = 0;
+volatile unsigned long uartRxRingFull = 0;
+volatile unsigned long uartFramingErrors = 0;
+volatile byte uartRxPeak = 0;
+byte uartTxPeak = 0;
+unsigned long uartTxRingFull = 0;
+unsigned long repliesDropped = 0;
+// CRC-8 of what has been written since it was cleared, beginReply clears it and endReply sends it
+byte replyCrc = 0;
+UartPort uart;
+
 /* Global variables */
 int switchInitialPosition = 0;
 // system is on when the switch is not in the initial position
 bool systemOn = false;
+// 64 bits device clock built over millis(), so it doesn't wrap after 49.7 days
+unsigned long lastMillisRead = 0;
+unsigned long long millisWrapsTime = 0;
+// when the serial port was inspected for the last time, a code arrived long after it may have been waiting in the buffer
+unsigned long long lastSerialInspectionTime = 0;
+// host clock estimation: last sync is the anchor for the offset, and the drift corrects the time elapsed since it
+bool hostClockSynced = false;
+unsigned long long syncDeviceTime = 0;
+unsigned long long syncHostTime = 0;
+// drift is measured between samples some minutes apart, so it has its own anchor
+unsigned long long driftDeviceTime = 0;
+unsigned long long driftHostTime = 0;
+long hostClockDriftPpm = 0;
+bool hostClockDriftMeasured = false;
+// phase currently shown(R, B or S) and when it started in host time, so the leds can advance without a state every second
+char currentPhase = 'S';
+byte currentPomodoros = 0;
+unsigned long long currentPhaseStartHostTime = 0;
+long lastSecondShown = -1;
+// code being received, it is interpreted when its '-' arrives
+char codeBuffer[CODE_BUFFER_SIZE];
+byte codeBufferLength = 0;
+bool droppingCode = false;
+// serial statistics, to check throughput under bursts
+unsigned long codesProcessed = 0;
+byte lastPassCodes = 0;
+byte mostPassCodes = 0;
+unsigned long bytesDropped = 0;
+unsigned long fullBufferPasses = 0;
+unsigned long badFrames = 0;
+// the host sends checksums, frames without them are garbled ones
+bool frameChecksums = false;
+// next sequence number expected from the host, -1 takes whatever comes first
+int expectedSequence = -1;
+// when the first char of the code being received was read
+unsigned long frameReadMicros = 0;
+// address on a shared line, read from the EEPROM at setup
+byte deviceAddress = BROADCAST_ADDRESS;
+// address set by "ADR", -1 if none, see interpretCode()
+int newDeviceAddress = -1;
+// the frame being received is for another tracker and is skipped, or is a broadcast one and is not answered
+bool skippingFrame = false;
+bool broadcastFrame = false;
+// CRC-8 of the address of the frame being received, taken out of the frame but covered by its checksum
+byte frameAddressCrc = 0;
+unsigned long framesForOthers = 0;
+// A traced code waiting for the leds to be written.
+struct PendingTrace {
+  unsigned int trace;
+  unsigned long long readTime;
+  unsigned long readMicros;
+  unsigned long dispatchMicros;
+};
+PendingTrace pendingTraces[TRACE_SLOTS];
+byte pendingTracesLength = 0;
+// An event of the flight recorder. Only the low 24 bits of the millis are kept, they wrap every 4.6 hours but the dump tells the millis it
+// was taken at.
+struct FlightRecord {
+  unsigned long time : 24;
+  char kind;
+  unsigned int data;
+};
+static_assert((FLIGHT_RECORDER_SIZE & (FLIGHT_RECORDER_SIZE - 1)) == 0, "flight recorder size must be a power of 2");
+// records ever written, the last FLIGHT_RECORDER_SIZE are kept
+FlightRecord flightRecorder[FLIGHT_RECORDER_SIZE];
+unsigned long flightRecords = 0;
+
+/* Led layers */
+// leds are handled as a mask, bit 0 is pin 2(green led 0) and bit 5 is pin 7(red led 0)
+#define FIRST_LED_PIN 2
+#define LEDS 6
+#define LED(pin) (1 << ((pin) - FIRST_LED_PIN))
+#define ALL_LEDS 0x3F
+#define GREEN_LEDS (LED(2) | LED(3) | LED(4))
+// overlay layers, an upper layer covers the ones below it. Host light games go one after the other in the game layer, the system on light game
+// is played by the device itself in the alert layer.
+#define GAME_LAYER 0
+#define ALERT_LAYER 1
+#define OVERLAY_LAYERS 2
+// host light games waiting for the one being played
+#define LIGHT_GAME_QUEUE_SIZE 4
+// light games, built in ones are in flash, uploaded ones are in the EEPROM and go by UPLOADED_LIGHT_GAME plus their slot
+#define SYSTEM_ON_LIGHT_GAME 0
+#define POMODORO_FINISHED_LIGHT_GAME 1
+#define POMODORO_N12_FINISHED_LIGHT_GAME 2
+#define POMODORO_N22_FINISHED_LIGHT_GAME 3
+#define BREAK_FINISHED_LIGHT_GAME 4
+#define BUILT_IN_LIGHT_GAMES 5
+#define UPLOADED_LIGHT_GAME 0x80
+// EEPROM slots for uploaded light games. A slot is its length(0 or 0xFF empty), its crc, the four LightGame bytes and 2 bytes per step: leds
+// in the 6 lower bits and duration in tens of milliseconds in the 10 upper ones
+#define UPLOADED_LIGHT_GAMES_ADDRESS 16
+#define UPLOADED_LIGHT_GAME_SLOTS 4
+#define UPLOADED_LIGHT_GAME_SLOT_SIZE 248
+#define UPLOADED_LIGHT_GAME_CHUNK_SIZE 8
+
+// A step of a light game, leds on and how many milliseconds they stay that way.
+struct LightGameStep {
+  byte leds;
+  unsigned int duration;
+};
+
+// A light game, its first loopSteps steps are played repetitions times, then the next finalSteps are played once. Only the opaqueLeds of the
+// layers below are covered.
+struct LightGame {
+  const LightGameStep* steps;
+  byte loopSteps;
+  byte repetitions;
+  byte finalSteps;
+  byte opaqueLeds;
+};
+
+// A light game being played on a layer. Uploaded ones read their steps from the EEPROM address, built in ones have it at 0.
+struct OverlayLayer {
+  byte lightGame;
+  LightGame game;
+  int uploadedStepsAddress;
+  bool active;
+  byte step;
+  byte repetition;
+  unsigned long stepStartTime;
+};
+
+// leds of the state being shown, set by show* functions
+byte baseLeds = 0;
+OverlayLayer overlayLayers[OVERLAY_LAYERS];
+// leds actually written to the pins
+byte shownLeds = 0;
+byte lightGameQueue[LIGHT_GAME_QUEUE_SIZE];
+byte lightGameQueueHead = 0;
+byte lightGameQueueLength = 0;
+
+/* Led bank */
+// uncomment to drive the charlieplexed bank, see Led bank above
+// #define CHARLIEPLEXED_LEDS
+#ifdef CHARLIEPLEXED_LEDS
+#define LED_BANK_ROWS LEDS
+#define LED_BANK_SIZE (LEDS * (LEDS - 1))
+#define MINUTE_LEDS 25
+#define MINUTE_BAR ((1UL << MINUTE_LEDS) - 1)
+// rows lit per second, timer 1 counts at F_CPU / 8
+#define LED_BANK_ROW_HZ 1200
+// pins 2 to 7 are bits 2 to 7 of PORTD, bits 0 and 1 are the serial port and are never touched
+#define LED_BANK_PINS 0xFC
+// anode of every row, and cathode of every led of the bank, as PORTD bits
+const byte ledBankRowPins[LED_BANK_ROWS] PROGMEM = {_BV(2), _BV(3), _BV(4), _BV(5), _BV(6), _BV(7)};
+const byte ledBankCathodePins[LED_BANK_SIZE] PROGMEM = {
+  _BV(3), _BV(4), _BV(5), _BV(6), _BV(7),
+  _BV(2), _BV(4), _BV(5), _BV(6), _BV(7),
+  _BV(2), _BV(3), _BV(5), _BV(6), _BV(7),
+  _BV(2), _BV(3), _BV(4), _BV(6), _BV(7),
+  _BV(2), _BV(3), _BV(4), _BV(5), _BV(7),
+  _BV(2), _BV(3), _BV(4), _BV(5), _BV(6)
+};
+// bank leds lit by each of the 6 leds: thirds of the minutes for the green ones, then blue, blue and red
+const unsigned long ledBankImages[LEDS] PROGMEM = {
+  0x000001FFUL, 0x0003FE00UL, 0x01FC0000UL, 1UL << 25, 1UL << 26, 1UL << 27
+};
+// minutes of the pomodoro shown while it runs
+byte pomodoroMinutes = 1;
+unsigned long ledBankImage = 0;
+// DDRD bits of every row, anode and lit cathodes, 0 if nothing is lit in it. Written by the loop and read by the interrupt
+volatile byte ledBankRowOutputs[LED_BANK_ROWS];
+volatile byte ledBankRow = 0;
+// interrupts and timer ticks spent in them(half microseconds), to know its CPU share
+volatile unsigned long ledBankInterrupts = 0;
+volatile unsigned long ledBankInterruptTicks = 0;
+volatile byte ledBankInterruptMostTicks = 0;
+#endif
+
+/* Code path profiling */
+// uncomment to count the cycles of the main code paths, see Profiling above
+// #define PATH_PROFILING
+#ifdef PATH_PROFILING
+#ifdef CHARLIEPLEXED_LEDS
+#error "PATH_PROFILING and CHARLIEPLEXED_LEDS both need timer 1"
+#endif
+// paths timed, in the order "PRF<path>" takes them
+#define SERIAL_INPUT_PATH 0
+#define SHOW_POMODORO_PATH 1
+#define SHOW_BREAK_PATH 2
+#define SHOW_STOPPED_PATH 3
+#define COMPOSE_LEDS_PATH 4
+#define PROFILED_PATHS 5
+// Runs and cycles of a path. Cycles go in 64 bits, 32 wrap after 268 seconds in the path.
+struct PathProfile {
+  unsigned long runs;
+  unsigned long long cycles;
+  unsigned long mostCycles;
+};
+PathProfile pathProfiles[PROFILED_PATHS];
+// timer 1 overflows every 65536 cycles(4 ms), its interrupt counts them so paths can take longer
+volatile unsigned int profileOverflows = 0;
+// cycles profileClock() and profilePath() take between them, measured at setup
+unsigned long profileOverheadCycles = 0;
+// runs a call timing it as a path
+#define PROFILE_PATH(path, ...) do { unsigned long pathStart = profileClock(); __VA_ARGS__; profilePath(path, pathStart); } while(0)
+#else
+#define PROFILE_PATH(path, ...) __VA_ARGS__
+#endif
+
+/* Energy accounting */
+// what the leds are showing: phases first(stopped, pomodoro, break), then built in light games, then uploaded slots
+#define ENERGY_PHASES 3
+#define ENERGY_SOURCES (ENERGY_PHASES + BUILT_IN_LIGHT_GAMES + UPLOADED_LIGHT_GAME_SLOTS)
+// counted when the leds or what they show change, and before reporting, so a loop pass with nothing new costs nothing
+unsigned long ledOnMillis[LEDS];
+unsigned long sourceMillis[ENERGY_SOURCES];
+unsigned long sourceLedMillis[ENERGY_SOURCES];
+unsigned long buzzerMillis = 0;
+unsigned long lastEnergyTime = 0;
+byte shownSource = 0;
+
+/* Light games */
+const LightGameStep systemOnLightGameSteps[] PROGMEM = {
+  {LED(7), 500}, {LED(6), 500}, {LED(5), 500}, {LED(4), 500}, {LED(3), 500}, {LED(2), 500}, {0, 500}
+};
+const LightGame systemOnLightGame PROGMEM = {systemOnLightGameSteps, 7, 1, 0, ALL_LEDS};
+
+const LightGameStep pomodoroFinishedLightGameSteps[] PROGMEM = {
+  // blink green leds 5 times
+  {0, 1000}, {LED(2) | LED(3) | LED(4), 1000},
+  // and off every green leds
+  {0, 1000}
+};
+const LightGame pomodoroFinishedLightGame PROGMEM = {pomodoroFinishedLightGameSteps, 2, 5, 1, ALL_LEDS};
+
+const LightGameStep pomodoroN12FinishedLightGameSteps[] PROGMEM = {
+  // leds light up from both ends to the middle and go off back, 4 times
+  {LED(2) | LED(7), 500},
+  {LED(2) | LED(3) | LED(6) | LED(7), 500},
+  {ALL_LEDS, 500},
+  {LED(2) | LED(3) | LED(6) | LED(7), 500},
+  {LED(2) | LED(7), 500},
+  {0, 500},
+  // rest
+  {0, 500}
+};
+const LightGame pomodoroN12FinishedLightGame PROGMEM = {pomodoroN12FinishedLightGameSteps, 6, 4, 1, ALL_LEDS};
+
+const LightGameStep pomodoroN22FinishedLightGameSteps[] PROGMEM = {
+  // one led runs from pin 2 to pin 7 and back, 20 times
+  {LED(2), 100}, {LED(3), 100}, {LED(4), 100}, {LED(5), 100}, {LED(6), 100},
+  {LED(7), 100}, {LED(6), 100}, {LED(5), 100}, {LED(4), 100}, {LED(3), 100},
+  // and ends where it started
+  {LED(2), 100}
+};
+const LightGame pomodoroN22FinishedLightGame PROGMEM = {pomodoroN22FinishedLightGameSteps, 10, 20, 1, ALL_LEDS};
+
+const LightGameStep breakFinishedLightGameSteps[] PROGMEM = {
+  // blink blue leds 2 times
+  {0, 1000}, {LED(5) | LED(6), 1000}
+};
+const LightGame breakFinishedLightGame PROGMEM = {breakFinishedLightGameSteps, 2, 2, 0, ALL_LEDS};
+
+// built in light games by number
+const LightGame* const builtInLightGames[] PROGMEM = {
+  &systemOnLightGame, &pomodoroFinishedLightGame, &pomodoroN12FinishedLightGame, &pomodoroN22FinishedLightGame, &breakFinishedLightGame
+};
+
+/* Melodies */
+// A note of a melody and its type, quarter note = 4, eighth note = 8, etc.
+struct MelodyNote {
+  unsigned int note;
+  byte noteType;
+};
+
+struct Melody {
+  const MelodyNote* notes;
+  byte length;
+};
+
+const MelodyNote sadMelodyNotes[] PROGMEM = {
+  {NOTE_E3, 8}, {NOTE_D3, 8}, {NOTE_C3, 2}
+};
+const Melody sadMelody PROGMEM = {sadMelodyNotes, 3};
+
+const MelodyNote happyMelodyNotes[] PROGMEM = {
+  {NOTE_C6, 8}, {NOTE_D6, 8}, {NOTE_E6, 8}
+};
+const Melody happyMelody PROGMEM = {happyMelodyNotes, 3};
+
+// melody being played on the buzzer
+Melody melodyPlaying;
+bool melodyActive = false;
+byte melodyNote = 0;
+unsigned long melodyNoteStartTime = 0;
 
 /* Arduino functions*/
 // This runs once.
 void setup() {
   // set input/output pings
+#ifdef CHARLIEPLEXED_LEDS
+  // the bank pins are set by the interrupt, timer 0 is millis() and timer 2 is tone() so timer 1 is the one left
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11);
+  OCR1A = F_CPU / 8 / LED_BANK_ROW_HZ - 1;
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts();
+#else
   pinMode(2, OUTPUT); 
   pinMode(3, OUTPUT);
   pinMode(4, OUTPUT);
   pinMode(5, OUTPUT);
   pinMode(6, OUTPUT);
   pinMode(7, OUTPUT);
+#endif
+#ifdef PATH_PROFILING
+  // timer 1 counting every cycle, from 0 to 65535 and over again
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  TIMSK1 |= _BV(TOIE1);
+  interrupts();
+  unsigned long measureStart = profileClock();
+  profileOverheadCycles = profileClock() - measureStart;
+#endif
   pinMode(8, INPUT);
   pinMode(12, OUTPUT);
   // system never start "on", doesn't matter in which position is the switch, its turning-on depends on the contrary state in which it begins
   switchInitialPosition = digitalRead(8);
   // open thy serial port
-  Serial.begin(9600);
+  uart.begin(SERIAL_BAUDS);
+  // who are we on a shared line
+  deviceAddress = EEPROM.read(DEVICE_ADDRESS_ADDRESS);
 }
 
 // This can run up to 16000 times per second, but most of the time runs around 3000 times per second.
@@ -99,11 +599,19 @@ void loop() {
   // main process
   if(systemOn) {
     // inspect serial port looking for input
-    inspectSerialPortInput();
+    PROFILE_PATH(SERIAL_INPUT_PATH, inspectSerialPortInput());
+    // advance the leds of the current phase by our own
+    updateLocalSchedule();
   } else {
     // shut down everything
     resetEverything();
   }
+  // blend the state and the light games into the leds
+  PROFILE_PATH(COMPOSE_LEDS_PATH, composeLeds());
+  // and keep the buzzer going
+  advanceMelody();
+  // keep the 64 bits clock aware of every millis() wrap
+  deviceClock();
 }
 
 /* Helper functions */
@@ -114,123 +622,601 @@ void checkSwitch() {
     if(digitalRead(8) == switchInitialPosition) {
       // the initial position is reached again
       systemOn = false;
+      recordFlight(FLIGHT_SWITCH, 0, 0);
     }
   } else {
     if(digitalRead(8) != switchInitialPosition) {
       systemOn = true;
-      // execute light game on on
+      recordFlight(FLIGHT_SWITCH, 1, 0);
+      // execute light game on on, it ends showing the system stopped
       makeSystemOnLightGame();
+      currentPhase = 'S';
+      PROFILE_PATH(SHOW_STOPPED_PATH, showSystemStopped());
       // flush the serial port
-      Serial.readString();
+      flushSerialInput();
     }
   }
 }
 
-// Triggered when system is turned on.
+// Drops what is waiting in the serial port without waiting for more. A code cut in half is dropped up to its end too.
+void flushSerialInput() {
+  char received = '-';
+  while(uart.available()) {
+    received = uart.read();
+    bytesDropped++;
+  }
+  codeBufferLength = 0;
+  skippingFrame = false;
+  broadcastFrame = false;
+  droppingCode = received != '-';
+}
+
+// Triggered when system is turned on. Played by the device itself, so it goes over any host light game.
 void makeSystemOnLightGame() {
-  digitalWrite(7, HIGH);
-  delay(500);
-  digitalWrite(7, LOW);
-  digitalWrite(6, HIGH);
-  delay(500);
-  digitalWrite(6, LOW);
-  digitalWrite(5, HIGH);
-  delay(500);
-  digitalWrite(5, LOW);
-  digitalWrite(4, HIGH);
-  delay(500);
-  digitalWrite(4, LOW);
-  digitalWrite(3, HIGH);
-  delay(500);
-  digitalWrite(3, LOW);
-  digitalWrite(2, HIGH);
-  delay(500);
-  digitalWrite(2, LOW);
-  delay(500);
-  digitalWrite(7, HIGH);
-}
-
-// Checks if Serial port has any data written on it. If it does, read it, and interpret it.
+  playLightGame(ALERT_LAYER, SYSTEM_ON_LIGHT_GAME);
+}
+
+// Checks if Serial port has any data written on it. If it does, read it, and interpret every complete code. Bursts are drained in batches bounded
+// by SERIAL_BUDGET_MICROS and SERIAL_BUDGET_CODES, so the receive buffer doesn't overflow and the leds keep moving meanwhile, and wait while
+// the transmit ring has no room for their replies.
 void inspectSerialPortInput() {
-  // check if there's at least one char to read
-  if(Serial.available()) {
-    // there is some data available to read
-    String code = Serial.readStringUntil('-');
-    // detect if the code talks about an event or state
-    if(isCodeAnEvent(code)) {
-      // event, find out which
-      if(code == "MSOLG") {
-        makeSystemOnLightGame();
-      } else if(code == "MPFLG") {
-        makePomodoroFinishedLightGame();
-      } else if(code == "MPN12FLG") {
-        makePomodoroN12FinishedLightGame();
-      } else if(code == "MPN22FLG") {
-        makePomodoroN22FinishedLightGame();
-      } else if(code == "MBFLG") {
-        makeBreakFinishedLightGame();
-      } else if(code == "SSB") {
-        soundSadBuzzer();
-      } else if(code == "SHB") {
-        soundHappyBuzzer();
-      } 
+  unsigned long passStartTime = micros();
+  byte passCodes = 0;
+  // a full ring has probably lost bytes, uartRxRingFull tells how many
+  if(uart.available() >= UART_RX_RING_SIZE - 1) {
+    fullBufferPasses++;
+  }
+  while(uart.available() && passCodes < SERIAL_BUDGET_CODES && (micros() - passStartTime) < SERIAL_BUDGET_MICROS &&
+        uart.availableForWrite() >= UART_REPLY_ROOM) {
+    char received = uart.read();
+    if(received == '-') {
+      // end of code
+      if(droppingCode) {
+        droppingCode = false;
+      } else if(skippingFrame) {
+        skippingFrame = false;
+      } else {
+        codeBuffer[codeBufferLength] = '\0';
+        handleFrame(codeBuffer);
+        passCodes++;
+        if(newDeviceAddress >= 0) {
+          deviceAddress = newDeviceAddress;
+          newDeviceAddress = -1;
+        }
+      }
+      codeBufferLength = 0;
+      broadcastFrame = false;
+      frameAddressCrc = 0;
+    } else if(skippingFrame) {
+      // another tracker's frame, nothing to do until it ends
+    } else if(droppingCode) {
+      bytesDropped++;
+    } else if(codeBufferLength < CODE_BUFFER_SIZE - 1) {
+      if(codeBufferLength == 0) {
+        frameReadMicros = micros();
+      }
+      codeBuffer[codeBufferLength++] = received;
+      // an address is decided as soon as it is read, and taken out of the frame
+      if(codeBufferLength == 3 && codeBuffer[0] == '>') {
+        int address = (hexDigit(codeBuffer[1]) << 4) | hexDigit(codeBuffer[2]);
+        broadcastFrame = address == BROADCAST_ADDRESS;
+        frameAddressCrc = crc8(crc8(crc8(0, codeBuffer[0]), codeBuffer[1]), codeBuffer[2]);
+        if(!broadcastFrame && address != deviceAddress) {
+          skippingFrame = true;
+          framesForOthers++;
+        }
+        codeBufferLength = 0;
+      }
+    } else {
+      // too long to be a code, drop it until the next '-'
+      bytesDropped += codeBufferLength + 1;
+      codeBufferLength = 0;
+      droppingCode = true;
+    }
+  }
+  codesProcessed += passCodes;
+  lastPassCodes = passCodes;
+  if(passCodes > mostPassCodes) {
+    mostPassCodes = passCodes;
+  }
+  // a code arriving long after this moment will have been waiting in the buffer
+  lastSerialInspectionTime = deviceClock();
+}
+
+// Takes a complete frame, a code that may come after a sequence number. Sequenced codes are done in order and acknowledged, so the host knows
+// how much more it can send.
+void handleFrame(char* frame) {
+  // checksum, "*XX" at the end: a frame garbled on the way is dropped before anything in it is believed, the host sends it again. Frames
+  // without one are taken from hosts that don't send them, once one came a frame without it has lost its '*' on the way
+  char* checksum = strrchr(frame, '*');
+  if(checksum != NULL) {
+    byte crc = frameAddressCrc;
+    for(char* next = frame; next < checksum; next++) {
+      crc = crc8(crc, *next);
+    }
+    if(strlen(checksum) != 3 || ((hexDigit(checksum[1]) << 4) | hexDigit(checksum[2])) != crc) {
+      badFrames++;
+      recordFlight(FLIGHT_BAD_FRAME, crc, strlen(frame));
+      return;
+    }
+    *checksum = '\0';
+    frameChecksums = true;
+  } else if(frameChecksums) {
+    // but for a host starting again without them, it starts with "SEQ"
+    if(strncmp(frame, "SEQ", 3) != 0) {
+      badFrames++;
+      recordFlight(FLIGHT_BAD_FRAME, 0, strlen(frame));
+      return;
+    }
+    frameChecksums = false;
+  }
+  // traced code
+  if(frame[0] == '@') {
+    char* code = strchr(frame, ':');
+    if(code == NULL) {
+      bytesDropped += strlen(frame) + 1;
+      return;
+    }
+    traceFrame(atol(frame + 1));
+    frame = code + 1;
+  }
+  if(frame[0] != '#') {
+    // plain code, nobody waits for an answer
+    takeCode(frame, -1);
+    return;
+  }
+  char* code = strchr(frame, ':');
+  if(code == NULL) {
+    // broken sequence number, the host will send it again
+    bytesDropped += strlen(frame) + 1;
+    return;
+  }
+  int sequence = atoi(frame + 1) & 0xFF;
+  if(expectedSequence == -1) {
+    expectedSequence = sequence;
+  }
+  // how far behind the expected one is it, codes up to 128 behind are repetitions of codes already done
+  byte behind = (expectedSequence - sequence) & 0xFF;
+  int rejectedSequence = -1;
+  if(behind >= 1 && behind <= 128) {
+    // already done
+  } else if(behind == 0 && codeFits(code + 1)) {
+    // done, or refused for good: it would be refused every time it came, and garbled frames don't get this far with checksums
+    takeCode(code + 1, sequence);
+    expectedSequence = (sequence + 1) & 0xFF;
+  } else {
+    // a code in between was lost, or this one doesn't fit now
+    rejectedSequence = sequence;
+    sequence = expectedSequence;
+  }
+  // "NAK255,255,127,4"
+  if(!beginReply(ACK_REPLY_LENGTH)) {
+    return;
+  }
+  if(rejectedSequence == -1) {
+    uart.print("ACK");
+  } else {
+    uart.print("NAK");
+    uart.print(rejectedSequence);
+    uart.print(',');
+  }
+  uart.print(sequence);
+  uart.print(',');
+  reportCredits();
+}
+
+// Does a code out of a frame, sequence -1 if it had none. It is recorded before, so what it causes comes after it in the flight recorder, and
+// marked if it is refused. Dumps of the recorder are not recorded, they would push out what they read.
+boolean takeCode(const char* code, int sequence) {
+  if(strncmp(code, "FLR", 3) == 0) {
+    return(interpretCode(String(code)));
+  }
+  byte crc = 0;
+  for(const char* next = code; *next != '\0'; next++) {
+    crc = crc8(crc, *next);
+  }
+  FlightRecord* record = recordFlight(FLIGHT_CODE, crc, sequence);
+  if(!interpretCode(String(code))) {
+    record->kind = FLIGHT_REFUSED;
+    return(false);
+  }
+  return(true);
+}
+
+// Light games wait in a queue, codes that queue one can't be taken while it is full.
+boolean codeFits(const char* code) {
+  size_t length = strlen(code);
+  boolean queued = (length >= 3 && strcmp(code + length - 3, "FLG") == 0) || strncmp(code, "PLG", 3) == 0;
+  return(!queued || lightGameSlotsFree() > 0);
+}
+
+// Keeps the times of a traced code about to be dispatched, they are reported when the leds are written. If there are too many the trace is lost.
+void traceFrame(unsigned int trace) {
+  if(pendingTracesLength >= TRACE_SLOTS || broadcastFrame) {
+    return;
+  }
+  PendingTrace* pending = &pendingTraces[pendingTracesLength++];
+  pending->trace = trace;
+  pending->dispatchMicros = micros();
+  pending->readMicros = frameReadMicros;
+  pending->readTime = deviceClock() - (pending->dispatchMicros - frameReadMicros) / 1000;
+}
+
+// Answers every traced code done since the last time the leds were written.
+void reportTraces() {
+  unsigned long commitMicros = micros();
+  for(byte index = 0; index < pendingTracesLength; index++) {
+    // trace, a device millis and two microseconds
+    if(!beginReply(3 + 5 + 1 + 12 + 1 + 10 + 1 + 10 + 2)) {
+      continue;
+    }
+    uart.print("TRC");
+    uart.print(pendingTraces[index].trace);
+    uart.print(',');
+    printClock(pendingTraces[index].readTime);
+    uart.print(',');
+    uart.print(pendingTraces[index].dispatchMicros - pendingTraces[index].readMicros);
+    uart.print(',');
+    uart.print(commitMicros - pendingTraces[index].readMicros);
+    endReply();
+  }
+  pendingTracesLength = 0;
+}
+
+// Prints what the host can still send: free bytes in the receive buffer and free slots in the light game queue, ends the line.
+void reportCredits() {
+  uart.print(UART_RX_RING_SIZE - 1 - uart.available());
+  uart.print(',');
+  uart.print(lightGameSlotsFree());
+  endReply();
+}
+
+// Does what a complete code asks for. Returns false when the code doesn't fit now, or is not known or broken.
+boolean interpretCode(String code) {
+  // detect if the code talks about an event or state
+  if(isCodeAnEvent(code)) {
+    // finished light games(*FLG) and uploaded ones(PLG*) wait in a queue
+    if(!codeFits(code.c_str())) {
+      return(false);
+    }
+    // event, find out which
+    if(code == "MSOLG") {
+      makeSystemOnLightGame();
+    } else if(code == "MPFLG") {
+      makePomodoroFinishedLightGame();
+    } else if(code == "MPN12FLG") {
+      makePomodoroN12FinishedLightGame();
+    } else if(code == "MPN22FLG") {
+      makePomodoroN22FinishedLightGame();
+    } else if(code == "MBFLG") {
+      makeBreakFinishedLightGame();
+    } else if(code == "SSB") {
+      soundSadBuzzer();
+    } else if(code == "SHB") {
+      soundHappyBuzzer();
+    } else if(code.startsWith("PLG")) {
+      if(code.length() != 4 || code[3] < '0' || code[3] >= '0' + UPLOADED_LIGHT_GAME_SLOTS) {
+        return(false);
+      }
+      queueLightGame(UPLOADED_LIGHT_GAME | (code[3] - '0'));
+    } else if(code.startsWith("ULG")) {
+      // a chunk that doesn't check out is refused, ULC finds the light game broken then
+      return(uploadLightGameChunk(code.c_str()));
+    } else if(code.startsWith("ULC")) {
+      return(checkUploadedLightGame(code.c_str()));
+    } else if(code == "STATS") {
+      reportSerialStatistics();
+    } else if(code == "UST") {
+      reportUartStatistics();
+    } else if(code.startsWith("NRG")) {
+      reportEnergy(code);
+    } else if(code.startsWith("FLR")) {
+      reportFlightRecorder(code);
+    } else if(code == "QST") {
+      reportState();
+#ifdef CHARLIEPLEXED_LEDS
+    } else if(code == "CPX") {
+      reportLedBank();
+#endif
+#ifdef PATH_PROFILING
+    } else if(code.startsWith("PRF")) {
+      return(reportPathProfile(code.c_str()));
+#endif
+    } else if(code.startsWith("CLK")) {
+      synchronizeClock(code.substring(3));
+    } else if(code.startsWith("SEQ")) {
+      // the host starts counting again
+      expectedSequence = code.substring(3).toInt() & 0xFF;
+      if(beginReply(code.length() + 10)) {
+        uart.print(code);
+        uart.print(',');
+        reportCredits();
+      }
+    } else if(code.startsWith("ADR") && code.length() == 5 && hexByte(code.c_str(), 3) >= 0) {
+      // new address, FF is none. It is taken once the frame is answered, the host waits for the answer with the old one
+      newDeviceAddress = hexByte(code.c_str(), 3);
+      EEPROM.update(DEVICE_ADDRESS_ADDRESS, newDeviceAddress);
+      if(beginReply(7)) {
+        uart.print(code);
+        endReply();
+      }
     } else {
-      // state, kind of "16R0288", this is pomodoros completed, actual state, seconds since beggining of actual phase, first thing of interest is state taking part now
-      switch(code[2]) {
-        case 'R':
-          // pomodoro running, pass the seconds since the start of it
-          showPomodoroRunning(code.substring(3).toInt());
-          break;
-        case 'B':
-          // break running, pass the amount of pomodoros completed
-          showBreakRunning(code.substring(0, 2).toInt());
-          break;
-        case 'S':
-          // stopped
-          showSystemStopped();
-          break;    
+      // unknown code, most likely a broken one
+      return(false);
+    }
+  } else {
+    // state, kind of "16R0288", this is pomodoros completed, actual state, seconds since beggining of actual phase, first thing of interest is state taking part now
+    for(byte position = 0; position < 7; position++) {
+      // a garbled state would show the wrong leds until the next one
+      if(position != 2 && !isDigit(code[position])) {
+        return(false);
       }
     }
+    // and a refused one changes nothing
+    if(code[2] != 'R' && code[2] != 'B' && code[2] != 'S') {
+      return(false);
+    }
+    char previousPhase = currentPhase;
+    byte previousPomodoros = currentPomodoros;
+    currentPomodoros = code.substring(0, 2).toInt();
+    currentPhaseStartHostTime = hostClock() - code.substring(3).toInt() * 1000ULL;
+    switch(code[2]) {
+      case 'R':
+        // pomodoro running, remember when it started in host time, from now on the leds advance locally
+        currentPhase = 'R';
+        lastSecondShown = code.substring(3).toInt();
+        // pass the seconds since the start of it
+        PROFILE_PATH(SHOW_POMODORO_PATH, showPomodoroRunning(lastSecondShown));
+        break;
+      case 'B':
+        // break running, pass the amount of pomodoros completed
+        currentPhase = 'B';
+        PROFILE_PATH(SHOW_BREAK_PATH, showBreakRunning(code.substring(0, 2).toInt()));
+        break;
+      case 'S':
+        // stopped
+        currentPhase = 'S';
+        PROFILE_PATH(SHOW_STOPPED_PATH, showSystemStopped());
+        break;    
+    }
+    if(currentPhase != previousPhase || currentPomodoros != previousPomodoros) {
+      recordFlight(FLIGHT_PHASE, currentPhase, currentPomodoros);
+    }
+  }
+  return(true);
+}
+
+// Answers a "STATS" code with the serial statistics.
+void reportSerialStatistics() {
+  // 7 counters, up to 10 digits
+  if(!beginReply(5 + 7 * 11 + 1)) {
+    return;
+  }
+  uart.print("STATS");
+  uart.print(codesProcessed);
+  uart.print(',');
+  uart.print(lastPassCodes);
+  uart.print(',');
+  uart.print(mostPassCodes);
+  uart.print(',');
+  uart.print(bytesDropped);
+  uart.print(',');
+  uart.print(fullBufferPasses);
+  uart.print(',');
+  uart.print(framesForOthers);
+  uart.print(',');
+  uart.print(badFrames);
+  endReply();
+}
+
+// Answers a "UST" code with what the serial port lost and how full its rings got.
+void reportUartStatistics() {
+  if(!beginReply(3 + 7 * 11 + 1)) {
+    return;
+  }
+  // 4 byte counters written by the interrupts, read with them off so they are not half updated
+  noInterrupts();
+  unsigned long rxOverruns = uartRxOverruns;
+  unsigned long rxRingFull = uartRxRingFull;
+  unsigned long framingErrors = uartFramingErrors;
+  interrupts();
+  uart.print("UST");
+  uart.print(rxOverruns);
+  uart.print(',');
+  uart.print(rxRingFull);
+  uart.print(',');
+  uart.print(framingErrors);
+  uart.print(',');
+  uart.print(uartRxPeak);
+  uart.print(',');
+  uart.print(uartTxPeak);
+  uart.print(',');
+  uart.print(uartTxRingFull);
+  uart.print(',');
+  uart.print(repliesDropped);
+  endReply();
+}
+
+// Answers a "QST" code with what the device is showing.
+void reportState() {
+  // "QST1,05R0600,3F,80,81,4,255"
+  if(!beginReply(30)) {
+    return;
+  }
+  uart.print("QST");
+  uart.print(PROTOCOL_VERSION);
+  uart.print(',');
+  printDigits(currentPomodoros, 2);
+  uart.print(currentPhase);
+  unsigned long long phaseSeconds = currentPhase == 'S' ? 0 : (hostClock() - currentPhaseStartHostTime) / 1000;
+  printDigits(phaseSeconds > 9999 ? 9999 : phaseSeconds, 4);
+  uart.print(',');
+  printHexByte(shownLeds);
+  for(byte layer = 0; layer < OVERLAY_LAYERS; layer++) {
+    uart.print(',');
+    if(overlayLayers[layer].active) {
+      printHexByte(overlayLayers[layer].lightGame);
+    } else {
+      uart.print('-');
+    }
+  }
+  uart.print(',');
+  uart.print(lightGameQueueLength);
+  uart.print(',');
+  uart.print(expectedSequence);
+  endReply();
+}
+
+// Number with leading zeros, like the states have them.
+void printDigits(unsigned long value, byte digits) {
+  for(unsigned long limit = 10; digits > 1; digits--, limit *= 10) {
+    if(value < limit) {
+      uart.print('0');
+    }
   }
+  uart.print(value);
 }
 
-// The code will have 7 characters length if it's a state, otherwise will be an event.
+// The code will have 7 characters length and begin with a digit if it's a state, otherwise will be an event.
 boolean isCodeAnEvent(String code) {
   int codeLength = code.length();
-  if(codeLength != 7) {
+  if(codeLength != 7 || !isDigit(code[0])) {
     return(true);
   } else {
     return(false);
   }
 }
 
+// Answers a "CLK" code NTP style and updates the host clock estimation. The host time is corrected by the time the code took to travel at
+// SERIAL_BAUDS(10 bits per char, '-' included), codes that waited in the buffer(the loop was busy) are answered but not used by the device.
+void synchronizeClock(String hostTimeCode) {
+  unsigned long long receiveTime = deviceClock();
+  unsigned long transmissionTime = ((hostTimeCode.length() + 4) * 10000UL) / SERIAL_BAUDS;
+  unsigned long long hostTime = parseClock(hostTimeCode) + transmissionTime;
+  // the host needs the three times to compute round trip and offset by itself
+  if(beginReply(3 + hostTimeCode.length() + 1 + 12 + 1 + 12 + 2)) {
+    uart.print("CLK");
+    uart.print(hostTimeCode);
+    uart.print(',');
+    printClock(receiveTime);
+    uart.print(',');
+    printClock(deviceClock());
+    endReply();
+  }
+  // waiting for the rest of the code is normal, waiting for a light game to finish is not
+  if((receiveTime - lastSerialInspectionTime) > transmissionTime + 20) {
+    return;
+  }
+  // the phase start is kept in host time. The first sync takes the clock from device time to host time, decades ahead, so the phase start
+  // moves with it. Later syncs correct the estimation and the phase with it, the correction is what the host clock says
+  boolean firstSync = !hostClockSynced;
+  unsigned long long previousHostTime = hostClock();
+  if(!hostClockDriftMeasured && !hostClockSynced) {
+    // first sample, only the offset is known
+    driftDeviceTime = receiveTime;
+    driftHostTime = hostTime;
+  } else if((receiveTime - driftDeviceTime) >= 60000) {
+    // minutes between samples, measure the drift in parts per million
+    long long deviceElapsed = receiveTime - driftDeviceTime;
+    long long hostElapsed = hostTime - driftHostTime;
+    long long sampleDriftPpm = ((hostElapsed - deviceElapsed) * 1000000LL) / deviceElapsed;
+    // a resonator doesn't drift 5%, the host clock has jumped, start measuring again
+    if(sampleDriftPpm > 50000 || sampleDriftPpm < -50000) {
+      hostClockDriftMeasured = false;
+    } else if(hostClockDriftMeasured) {
+      // smooth it a bit
+      hostClockDriftPpm = (3 * hostClockDriftPpm + sampleDriftPpm) / 4;
+    } else {
+      hostClockDriftPpm = sampleDriftPpm;
+      hostClockDriftMeasured = true;
+    }
+    driftDeviceTime = receiveTime;
+    driftHostTime = hostTime;
+  }
+  // the offset is refreshed with every sample
+  syncDeviceTime = receiveTime;
+  syncHostTime = hostTime;
+  hostClockSynced = true;
+  if(firstSync) {
+    currentPhaseStartHostTime += hostClock() - previousHostTime;
+  }
+}
+
+// Milliseconds since the Arduino started, in 64 bits. Has to be called at least once every 49.7 days to notice the millis() wraps, loop() does it.
+unsigned long long deviceClock() {
+  unsigned long now = millis();
+  // millis() went back to zero
+  if(now < lastMillisRead) {
+    millisWrapsTime += 0x100000000ULL;
+  }
+  lastMillisRead = now;
+  return(millisWrapsTime + now);
+}
+
+// Estimation of the host clock, in milliseconds. Without any sync the device clock is the best guess.
+unsigned long long hostClock() {
+  unsigned long long now = deviceClock();
+  if(!hostClockSynced) {
+    return(now);
+  }
+  long long elapsed = now - syncDeviceTime;
+  if(!hostClockDriftMeasured) {
+    return(syncHostTime + elapsed);
+  }
+  return(syncHostTime + elapsed + (elapsed * hostClockDriftPpm) / 1000000LL);
+}
+
+// String::toInt() only reaches 32 bits, host millis need 64.
+unsigned long long parseClock(String digits) {
+  unsigned long long time = 0;
+  for(unsigned int position = 0; position < digits.length() && isDigit(digits[position]); position++) {
+    time = time * 10 + (digits[position] - '0');
+  }
+  return(time);
+}
+
+// uart.print() doesn't know about 64 bits numbers either.
+void printClock(unsigned long long time) {
+  char digits[21];
+  byte position = 20;
+  digits[position] = '\0';
+  do {
+    digits[--position] = '0' + (time % 10);
+    time /= 10;
+  } while(time > 0);
+  uart.print(&digits[position]);
+}
+
+// Advances the pomodoro leds with the host clock estimation, so the host doesn't need to send a state every second. Accuracy is the state
+// resolution(1 second) plus the clock error, an uncorrected resonator can be 0.5% off(7.5 seconds per pomodoro), once the drift is measured with
+// syncs a few minutes apart it stays under 100 ms per pomodoro.
+void updateLocalSchedule() {
+  if(currentPhase == 'R') {
+    long secondsSincePomodoroStart = (hostClock() - currentPhaseStartHostTime) / 1000;
+    // only touch the leds when a new second is reached
+    if(secondsSincePomodoroStart != lastSecondShown) {
+      lastSecondShown = secondsSincePomodoroStart;
+      PROFILE_PATH(SHOW_POMODORO_PATH, showPomodoroRunning(secondsSincePomodoroStart));
+    }
+  }
+}
+
 // Shows to the user leds that represent a pomodoro running.
 void showPomodoroRunning(long secondsSincePomodoroStart) {
+#ifdef CHARLIEPLEXED_LEDS
+  // first led on at minute 0, like the first green one
+  pomodoroMinutes = secondsSincePomodoroStart / 60 >= MINUTE_LEDS ? MINUTE_LEDS : secondsSincePomodoroStart / 60 + 1;
+#endif
   // depending on how many seconds has passed since the start of the pomodoro, 1, 2 or 3 green leds will be on
   if(secondsSincePomodoroStart > 1000) {
     // 3 leds on
-    digitalWrite(2, HIGH);
-    digitalWrite(3, HIGH);
-    digitalWrite(4, HIGH);
-    digitalWrite(5, LOW);
-    digitalWrite(6, LOW);
-    digitalWrite(7, LOW);
+    baseLeds = LED(2) | LED(3) | LED(4);
   } else if(secondsSincePomodoroStart > 500) {
     // 2 leds on
-    digitalWrite(2, HIGH);
-    digitalWrite(3, HIGH);
-    digitalWrite(4, LOW);
-    digitalWrite(5, LOW);
-    digitalWrite(6, LOW);
-    digitalWrite(7, LOW);
+    baseLeds = LED(2) | LED(3);
   } else {
     // 1 led on
-    digitalWrite(2, HIGH);
-    digitalWrite(3, LOW);
-    digitalWrite(4, LOW);
-    digitalWrite(5, LOW);
-    digitalWrite(6, LOW);
-    digitalWrite(7, LOW);
+    baseLeds = LED(2);
   }
 }
 
@@ -239,178 +1225,706 @@ void showBreakRunning(long pomodorosCompleted) {
   // check if on long or short break
   if((pomodorosCompleted % 4) == 0) {
     // long
-    digitalWrite(2, LOW);
-    digitalWrite(3, LOW);
-    digitalWrite(4, LOW);
-    digitalWrite(5, HIGH);
-    digitalWrite(6, HIGH);
-    digitalWrite(7, LOW);
+    baseLeds = LED(5) | LED(6);
   } else {
     // short
-    digitalWrite(2, LOW);
-    digitalWrite(3, LOW);
-    digitalWrite(4, LOW);
-    digitalWrite(5, HIGH);
-    digitalWrite(6, LOW);
-    digitalWrite(7, LOW);
+    baseLeds = LED(5);
   }
 }
 
 // Shows to the user leds that represent the system stopped.
 void showSystemStopped() {
-  digitalWrite(2, LOW);
-  digitalWrite(3, LOW);
-  digitalWrite(4, LOW);
-  digitalWrite(5, LOW);
-  digitalWrite(6, LOW);
-  digitalWrite(7, HIGH);
+  baseLeds = LED(7);
 }
 
 // :( Why did you interrupted that pomodoro? Bio meaby? Is ok...
 void soundSadBuzzer() {
-  // setup of notes
-  int melody[] = {
-    NOTE_E3, NOTE_D3, NOTE_C3
-   };
-  int noteDurations[] = {
-    8, 8, 2
-  };
-  // iterate over the notes of the melody:
-  for (int thisNote = 0; thisNote < 3; thisNote++) {
-    // to calculate the note duration, take one second divided by the note type i.e.: quarter note = 1000 / 4, eighth note = 1000/8, etc.
-    int noteDuration = 1000 / noteDurations[thisNote];
-    tone(12, melody[thisNote], noteDuration);
-    // to distinguish the notes, set a minimum time between them; the note's duration + 30% seems to work well
-    int pauseBetweenNotes = noteDuration * 1.30;
-    delay(pauseBetweenNotes);
-    // stop the tone playing:
-    noTone(12);
-  }
+  playMelody(&sadMelody);
 }
 
 // Yes! Completed!
 void soundHappyBuzzer() {
-  // setup of notes
-  int melody[] = {
-    NOTE_C6, NOTE_D6, NOTE_E6
-   };
-  int noteDurations[] = {
-    8, 8, 8
-  };
-  // iterate over the notes of the melody:
-  for (int thisNote = 0; thisNote < 3; thisNote++) {
-    // to calculate the note duration, take one second divided by the note type i.e.: quarter note = 1000 / 4, eighth note = 1000/8, etc.
-    int noteDuration = 1000 / noteDurations[thisNote];
-    tone(12, melody[thisNote], noteDuration);
-    // to distinguish the notes, set a minimum time between them; the note's duration + 30% seems to work well
-    int pauseBetweenNotes = noteDuration * 1.30;
-    delay(pauseBetweenNotes);
-    // stop the tone playing:
-    noTone(12);
+  playMelody(&happyMelody);
+}
+
+// Starts a melody, replacing the one being played if any.
+void playMelody(const Melody* melody) {
+  memcpy_P(&melodyPlaying, melody, sizeof(Melody));
+  melodyNote = 0;
+  melodyActive = true;
+  melodyNoteStartTime = millis();
+  // tone() plays in the background for the given time
+  unsigned int noteDuration = 1000 / pgm_read_byte(&melodyPlaying.notes[0].noteType);
+  tone(12, pgm_read_word(&melodyPlaying.notes[0].note), noteDuration);
+  buzzerMillis += noteDuration;
+}
+
+// Moves to the next note when the current one and its pause are done, so a melody doesn't block the loop.
+void advanceMelody() {
+  if(!melodyActive) {
+    return;
+  }
+  // to calculate the note duration, take one second divided by the note type i.e.: quarter note = 1000 / 4, eighth note = 1000/8, etc.
+  unsigned int noteDuration = 1000 / pgm_read_byte(&melodyPlaying.notes[melodyNote].noteType);
+  // to distinguish the notes, set a minimum time between them; the note's duration + 30% seems to work well
+  unsigned int pauseBetweenNotes = noteDuration * 1.30;
+  if((millis() - melodyNoteStartTime) < pauseBetweenNotes) {
+    return;
   }
+  // stop the tone playing:
+  noTone(12);
+  melodyNote++;
+  if(melodyNote >= melodyPlaying.length) {
+    melodyActive = false;
+    return;
+  }
+  melodyNoteStartTime += pauseBetweenNotes;
+  noteDuration = 1000 / pgm_read_byte(&melodyPlaying.notes[melodyNote].noteType);
+  tone(12, pgm_read_word(&melodyPlaying.notes[melodyNote].note), noteDuration);
+  buzzerMillis += noteDuration;
 }
 
 // Executes the light game triggered by the finish of a pomodoro.
 void makePomodoroFinishedLightGame() {
-  // clean leds just in case
-  resetEverything();
-  // do the game
-  for(int counter = 0; counter < 5; counter++) {
-    // turn off all green leds
-    digitalWrite(2, LOW);
-    digitalWrite(3, LOW);
-    digitalWrite(4, LOW);
-    // rest
-    delay(1000);
-    // turn on all green leds
-    digitalWrite(2, HIGH);
-    digitalWrite(3, HIGH);
-    digitalWrite(4, HIGH);
-    // rest
-    delay(1000);
-  }
-  // and off every green leds
-  digitalWrite(2, LOW);
-  digitalWrite(3, LOW);
-  digitalWrite(4, LOW);
-  delay(1000);
+  queueLightGame(POMODORO_FINISHED_LIGHT_GAME);
 }
 
 // Called when pomodoro number 12 is reached.
 void makePomodoroN12FinishedLightGame() {
-  // clean leds just in case
-  resetEverything();
-  // do the game
-  for(int counter = 0; counter < 4; counter++) {
-    digitalWrite(2, HIGH);
-    digitalWrite(7, HIGH);
-    delay(500);
-    digitalWrite(3, HIGH);
-    digitalWrite(6, HIGH);
-    delay(500);
-    digitalWrite(4, HIGH);
-    digitalWrite(5, HIGH);
-    delay(500);
-    digitalWrite(4, LOW);
-    digitalWrite(5, LOW);
-    delay(500);
-    digitalWrite(3, LOW);
-    digitalWrite(6, LOW);
-    delay(500);
-    digitalWrite(2, LOW);
-    digitalWrite(7, LOW);
-    delay(500);
-  }
-  delay(500);
+  queueLightGame(POMODORO_N12_FINISHED_LIGHT_GAME);
 }
 
 // Called when pomodoro number 22 is reached.
 void makePomodoroN22FinishedLightGame() {
-  // clean leds just in case
-  resetEverything();
-  // do the game
-  int led;
-  bool currentState = 1;
-  digitalWrite(2, HIGH);
-  delay(100);
-  digitalWrite(2, LOW);
-  for(int counter = 0; counter < 20; counter++) {
-    for(led = 3; led < 8; led++) {
-      digitalWrite(led, HIGH);
-      delay(100);
-      digitalWrite(led, LOW);
+  queueLightGame(POMODORO_N22_FINISHED_LIGHT_GAME);
+}
+
+// Triggered when break time is done.
+void makeBreakFinishedLightGame() {
+  queueLightGame(BREAK_FINISHED_LIGHT_GAME);
+}
+
+// Starts a light game on a layer, replacing whatever that layer was playing. Returns false if it is an uploaded one not good to play.
+boolean playLightGame(byte layer, byte lightGame) {
+  OverlayLayer* overlay = &overlayLayers[layer];
+  if(lightGame & UPLOADED_LIGHT_GAME) {
+    int address = UPLOADED_LIGHT_GAMES_ADDRESS + (lightGame & ~UPLOADED_LIGHT_GAME) * UPLOADED_LIGHT_GAME_SLOT_SIZE;
+    byte length = EEPROM.read(address);
+    if(length == 0 || length == 0xFF) {
+      return(false);
+    }
+    overlay->game.loopSteps = EEPROM.read(address + 2);
+    overlay->game.repetitions = EEPROM.read(address + 3);
+    overlay->game.finalSteps = EEPROM.read(address + 4);
+    overlay->game.opaqueLeds = EEPROM.read(address + 5);
+    overlay->uploadedStepsAddress = address + 6;
+  } else {
+    memcpy_P(&overlay->game, (const LightGame*)pgm_read_ptr(&builtInLightGames[lightGame]), sizeof(LightGame));
+    overlay->uploadedStepsAddress = 0;
+  }
+  overlay->lightGame = lightGame;
+  overlay->active = true;
+  overlay->step = 0;
+  overlay->repetition = 0;
+  overlay->stepStartTime = millis();
+  recordFlight(FLIGHT_GAME_START, layer, lightGame);
+  return(true);
+}
+
+// Host light games are played one after the other, as they were when they used to block the loop. If the queue is full the game is lost.
+void queueLightGame(byte lightGame) {
+  if(!overlayLayers[GAME_LAYER].active) {
+    playLightGame(GAME_LAYER, lightGame);
+  } else if(lightGameQueueLength < LIGHT_GAME_QUEUE_SIZE) {
+    lightGameQueue[(lightGameQueueHead + lightGameQueueLength) % LIGHT_GAME_QUEUE_SIZE] = lightGame;
+    lightGameQueueLength++;
+  }
+}
+
+// Leds and duration of the step a layer is playing, from flash or, for uploaded light games, from the EEPROM.
+void readLightGameStep(OverlayLayer* overlay, byte* leds, unsigned int* duration) {
+  if(overlay->uploadedStepsAddress) {
+    unsigned int step = EEPROM.read(overlay->uploadedStepsAddress + 2 * overlay->step) | (EEPROM.read(overlay->uploadedStepsAddress + 2 * overlay->step + 1) << 8);
+    *leds = step & ALL_LEDS;
+    *duration = (step >> LEDS) * 10;
+  } else {
+    *leds = pgm_read_byte(&overlay->game.steps[overlay->step].leds);
+    *duration = pgm_read_word(&overlay->game.steps[overlay->step].duration);
+  }
+}
+
+// Writes a chunk of an uploaded light game, "ULG<slot><offset><data><crc>". Returns false if it doesn't check out. Writing the EEPROM takes
+// 3.3 ms per byte, so a chunk takes most of a loop pass but the leds keep moving between chunks. Every chunk empties the slot until the
+// light game is checked, refused chunks are not sent again and the slot can't play half an old light game.
+boolean uploadLightGameChunk(const char* code) {
+  int codeLength = strlen(code);
+  if(codeLength < 10 || (codeLength % 2) != 0) {
+    return(false);
+  }
+  int slot = code[3] - '0';
+  int offset = hexByte(code, 4);
+  int dataLength = (codeLength - 8) / 2;
+  if(slot < 0 || slot >= UPLOADED_LIGHT_GAME_SLOTS || offset < 0 || dataLength > UPLOADED_LIGHT_GAME_CHUNK_SIZE ||
+     offset + dataLength > UPLOADED_LIGHT_GAME_SLOT_SIZE - 2) {
+    return(false);
+  }
+  // check it all before writing anything
+  byte data[UPLOADED_LIGHT_GAME_CHUNK_SIZE];
+  byte crc = crc8(crc8(0, slot), offset);
+  for(int position = 0; position < dataLength; position++) {
+    int value = hexByte(code, 6 + 2 * position);
+    if(value < 0) {
+      return(false);
     }
-    for(led = 6; led > 1; led--) {
-      digitalWrite(led, HIGH);
-      delay(100);
-      digitalWrite(led, LOW);
+    data[position] = value;
+    crc = crc8(crc, value);
+  }
+  if(hexByte(code, codeLength - 2) != crc) {
+    return(false);
+  }
+  int address = UPLOADED_LIGHT_GAMES_ADDRESS + slot * UPLOADED_LIGHT_GAME_SLOT_SIZE;
+  EEPROM.update(address, 0);
+  for(int position = 0; position < dataLength; position++) {
+    EEPROM.update(address + 2 + offset + position, data[position]);
+  }
+  return(true);
+}
+
+// Checks an uploaded light game, "ULC<slot><length><crc>", and makes it playable if it is whole, empties the slot if not. Returns false if
+// the code itself is broken.
+boolean checkUploadedLightGame(const char* code) {
+  if(strlen(code) != 8) {
+    return(false);
+  }
+  int slot = code[3] - '0';
+  int length = hexByte(code, 4);
+  int expectedCrc = hexByte(code, 6);
+  if(slot < 0 || slot >= UPLOADED_LIGHT_GAME_SLOTS || length < 6 || length > UPLOADED_LIGHT_GAME_SLOT_SIZE - 2 || expectedCrc < 0) {
+    return(false);
+  }
+  int address = UPLOADED_LIGHT_GAMES_ADDRESS + slot * UPLOADED_LIGHT_GAME_SLOT_SIZE;
+  byte crc = 0;
+  for(int position = 0; position < length; position++) {
+    crc = crc8(crc, EEPROM.read(address + 2 + position));
+  }
+  // steps must fit in what was uploaded
+  int steps = EEPROM.read(address + 2) + EEPROM.read(address + 4);
+  boolean good = crc == expectedCrc && 4 + 2 * steps <= length && steps > 0;
+  // a broken one is emptied, what the host wanted isn't there and what was there before may be half overwritten
+  if(good) {
+    EEPROM.update(address + 1, expectedCrc);
+  }
+  EEPROM.update(address, good ? length : 0);
+  if(beginReply(10)) {
+    uart.print("ULC");
+    uart.print(code[3]);
+    uart.print(good ? ",OK" : ",BAD");
+    endReply();
+  }
+  return(true);
+}
+
+// Byte written as 2 hex digits at a position of the code, -1 if they are not hex. The position has to be inside the code, the end of it
+// is not hex so the second digit is only read if the first one is.
+int hexByte(const char* code, unsigned int position) {
+  int high = hexDigit(code[position]);
+  if(high < 0) {
+    return(-1);
+  }
+  int low = hexDigit(code[position + 1]);
+  if(low < 0) {
+    return(-1);
+  }
+  return((high << 4) | low);
+}
+
+// Value of an uppercase hex digit, -1 if it is not one.
+int hexDigit(char hex) {
+  if(hex >= '0' && hex <= '9') {
+    return(hex - '0');
+  } else if(hex >= 'A' && hex <= 'F') {
+    return(hex - 'A' + 10);
+  }
+  return(-1);
+}
+
+// Starts a line to the host, with our address if we have one, if the transmit ring has room for the whole line: length characters, line end
+// included. Returns false while handling a broadcast frame, those are not answered, or if there's no room, a line cut in half is worse than
+// a line lost(the host asks again). The address and the checksum are not counted in length, the checksum covers the address too.
+boolean beginReply(byte length) {
+  if(broadcastFrame) {
+    return(false);
+  }
+  if(uart.availableForWrite() < length + REPLY_FRAMING) {
+    repliesDropped++;
+    return(false);
+  }
+  replyCrc = 0;
+  if(deviceAddress != BROADCAST_ADDRESS) {
+    uart.print('>');
+    printHexByte(deviceAddress);
+  }
+  return(true);
+}
+
+// Ends a line started with beginReply, with the checksum of it.
+void endReply() {
+  byte crc = replyCrc;
+  uart.print('*');
+  printHexByte(crc);
+  uart.println();
+}
+
+// 2 hex digits, uart.print(value, HEX) drops the leading zero.
+void printHexByte(byte value) {
+  uart.print("0123456789ABCDEF"[value >> 4]);
+  uart.print("0123456789ABCDEF"[value & 0x0F]);
+}
+
+// One more byte in a CRC-8(polynomial 0x07).
+byte crc8(byte crc, byte data) {
+  crc ^= data;
+  for(byte bit = 0; bit < 8; bit++) {
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return(crc);
+}
+
+// Light games that can be taken now: free slots of the queue, plus the game layer itself when nothing is being played.
+byte lightGameSlotsFree() {
+  if(!overlayLayers[GAME_LAYER].active) {
+    return(LIGHT_GAME_QUEUE_SIZE + 1);
+  }
+  return(LIGHT_GAME_QUEUE_SIZE - lightGameQueueLength);
+}
+
+// Moves a layer to the step it should be showing now. If the loop was late more than one step may be skipped, the light game keeps its length.
+void advanceOverlayLayer(byte layer) {
+  OverlayLayer* overlay = &overlayLayers[layer];
+  byte leds;
+  unsigned int duration;
+  while(overlay->active) {
+    readLightGameStep(overlay, &leds, &duration);
+    if((millis() - overlay->stepStartTime) < duration) {
+      return;
+    }
+    overlay->stepStartTime += duration;
+    overlay->step++;
+    if(overlay->step == overlay->game.loopSteps && ++overlay->repetition < overlay->game.repetitions) {
+      // loop again
+      overlay->step = 0;
+    } else if(overlay->step >= overlay->game.loopSteps + overlay->game.finalSteps) {
+      // light game finished, the next one in the queue starts where this one ended
+      overlay->active = false;
+      recordFlight(FLIGHT_GAME_END, layer, overlay->lightGame);
+      while(layer == GAME_LAYER && !overlay->active && lightGameQueueLength > 0) {
+        unsigned long endTime = overlay->stepStartTime;
+        // an uploaded light game may have been erased meanwhile, then the next one goes
+        if(playLightGame(GAME_LAYER, lightGameQueue[lightGameQueueHead])) {
+          overlay->stepStartTime = endTime;
+        }
+        lightGameQueueHead = (lightGameQueueHead + 1) % LIGHT_GAME_QUEUE_SIZE;
+        lightGameQueueLength--;
+      }
     }
   }
 }
 
-// Triggered when break time is done.
-void makeBreakFinishedLightGame() {
-  // clean leds just in case
-  resetEverything();
-  // do the game
-  for(int counter = 0; counter < 2; counter++) {
-    digitalWrite(5, LOW);
-    digitalWrite(6, LOW);
-    delay(1000);
-    digitalWrite(5, HIGH);
-    digitalWrite(6, HIGH);
-    delay(1000);
-  }
-  // clean leds
-  resetEverything();
-}
-
-// Called when system has been turned off. Resets everything to its pristine status.
+// Blends the base layer and the overlays, and writes to the pins only the leds that changed. Costs the same every loop.
+void composeLeds() {
+  byte leds = baseLeds;
+  for(byte layer = 0; layer < OVERLAY_LAYERS; layer++) {
+    advanceOverlayLayer(layer);
+    OverlayLayer* overlay = &overlayLayers[layer];
+    if(overlay->active) {
+      byte overlayLeds;
+      unsigned int duration;
+      readLightGameStep(overlay, &overlayLeds, &duration);
+      leds = (leds & ~overlay->game.opaqueLeds) | (overlayLeds & overlay->game.opaqueLeds);
+    }
+  }
+  byte changedLeds = leds ^ shownLeds;
+  byte source = energySource();
+  if(changedLeds || source != shownSource) {
+    // what was shown until now is accounted before it changes
+    accountEnergy();
+    shownSource = source;
+  }
+#ifdef CHARLIEPLEXED_LEDS
+  showOnLedBank(leds);
+#else
+  for(byte led = 0; led < LEDS; led++) {
+    if(changedLeds & (1 << led)) {
+      digitalWrite(FIRST_LED_PIN + led, (leds >> led) & 1);
+    }
+  }
+#endif
+  shownLeds = leds;
+  // traced codes are done when their leds are
+  if(pendingTracesLength > 0) {
+    reportTraces();
+  }
+}
+
+#ifdef CHARLIEPLEXED_LEDS
+// Lights the bank as the 6 leds would be. While a pomodoro runs and no light game covers the green leds, they show a led per minute instead.
+// Rows are only worked out again when the image changes.
+void showOnLedBank(byte leds) {
+  unsigned long image = 0;
+  for(byte led = 0; led < LEDS; led++) {
+    if(leds & (1 << led)) {
+      image |= pgm_read_dword(&ledBankImages[led]);
+    }
+  }
+  byte coveredLeds = 0;
+  for(byte layer = 0; layer < OVERLAY_LAYERS; layer++) {
+    if(overlayLayers[layer].active) {
+      coveredLeds |= overlayLayers[layer].game.opaqueLeds;
+    }
+  }
+  if(currentPhase == 'R' && !(coveredLeds & GREEN_LEDS)) {
+    image = (image & ~MINUTE_BAR) | ((1UL << pomodoroMinutes) - 1);
+  }
+  if(image == ledBankImage) {
+    return;
+  }
+  ledBankImage = image;
+  for(byte row = 0; row < LED_BANK_ROWS; row++) {
+    byte outputs = 0;
+    for(byte column = 0; column < LEDS - 1; column++) {
+      byte led = row * (LEDS - 1) + column;
+      if(image & (1UL << led)) {
+        outputs |= pgm_read_byte(&ledBankCathodePins[led]);
+      }
+    }
+    // a single byte, the interrupt sees the old row or the new one
+    ledBankRowOutputs[row] = outputs ? outputs | pgm_read_byte(&ledBankRowPins[row]) : 0;
+  }
+}
+
+// Lights the next row of the bank: every bank pin an input, the anode high, then the anode and the lit cathodes outputs(cathodes are low).
+ISR(TIMER1_COMPA_vect) {
+  DDRD &= ~LED_BANK_PINS;
+  PORTD = (PORTD & ~LED_BANK_PINS) | pgm_read_byte(&ledBankRowPins[ledBankRow]);
+  DDRD |= ledBankRowOutputs[ledBankRow];
+  ledBankRow = ledBankRow + 1 == LED_BANK_ROWS ? 0 : ledBankRow + 1;
+  // timer ticks since the compare match, so latency and prologue are counted too
+  byte ticks = TCNT1;
+  ledBankInterrupts++;
+  ledBankInterruptTicks += ticks;
+  if(ticks > ledBankInterruptMostTicks) {
+    ledBankInterruptMostTicks = ticks;
+  }
+}
+
+// Answers a "CPX" code with what the bank interrupt takes.
+void reportLedBank() {
+  if(!beginReply(3 + 3 * 11 + 2)) {
+    return;
+  }
+  // 4 byte counters, read with the interrupt off so they are not half updated
+  noInterrupts();
+  unsigned long rows = ledBankInterrupts;
+  unsigned long ticks = ledBankInterruptTicks;
+  byte mostTicks = ledBankInterruptMostTicks;
+  interrupts();
+  uart.print("CPX");
+  uart.print(rows);
+  uart.print(',');
+  uart.print(ticks);
+  uart.print(',');
+  uart.print(mostTicks);
+  endReply();
+}
+#endif
+
+#ifdef PATH_PROFILING
+// Counts the overflows of timer 1, so it makes a 32 bits cycle counter.
+ISR(TIMER1_OVF_vect) {
+  profileOverflows++;
+}
+
+// Cycles since setup, wrapping after 268 seconds, a path is way shorter. An overflow not counted yet by its interrupt is counted here.
+unsigned long profileClock() {
+  noInterrupts();
+  unsigned int overflows = profileOverflows;
+  unsigned int cycles = TCNT1;
+  if((TIFR1 & _BV(TOV1)) && cycles < 0x8000) {
+    overflows++;
+  }
+  interrupts();
+  return(((unsigned long)overflows << 16) | cycles);
+}
+
+// Adds a run of a path that started at start, as profileClock() told.
+void profilePath(byte path, unsigned long start) {
+  unsigned long cycles = profileClock() - start;
+  cycles = cycles > profileOverheadCycles ? cycles - profileOverheadCycles : 0;
+  PathProfile* profile = &pathProfiles[path];
+  profile->runs++;
+  profile->cycles += cycles;
+  if(cycles > profile->mostCycles) {
+    profile->mostCycles = cycles;
+  }
+}
+
+// Answers a "PRF" code with how many paths are timed, and a "PRF<path>" one with that path. Returns false for a path that isn't.
+boolean reportPathProfile(const char* code) {
+  if(code[3] == '\0') {
+    if(beginReply(3 + 1 + 1 + 10 + 2)) {
+      uart.print("PRF");
+      uart.print(PROFILED_PATHS);
+      uart.print(',');
+      uart.print(profileOverheadCycles);
+      endReply();
+    }
+    return(true);
+  }
+  byte path = code[3] - '0';
+  if(path >= PROFILED_PATHS || code[4] != '\0') {
+    return(false);
+  }
+  // runs, 64 bits cycles and most cycles
+  if(!beginReply(3 + 1 + 1 + 10 + 1 + 20 + 1 + 10 + 2)) {
+    return(true);
+  }
+  PathProfile* profile = &pathProfiles[path];
+  uart.print("PRF");
+  uart.print(path);
+  uart.print(',');
+  uart.print(profile->runs);
+  uart.print(',');
+  printClock(profile->cycles);
+  uart.print(',');
+  uart.print(profile->mostCycles);
+  endReply();
+  return(true);
+}
+#endif
+
+// What the leds are showing, the light game of the upper active layer or else the phase. With the switch off the phase is kept for when it
+// is turned on again, but nothing is shown, that goes to stopped.
+byte energySource() {
+  if(!systemOn) {
+    return(0);
+  }
+  for(byte layer = OVERLAY_LAYERS; layer-- > 0; ) {
+    OverlayLayer* overlay = &overlayLayers[layer];
+    if(overlay->active) {
+      if(overlay->lightGame & UPLOADED_LIGHT_GAME) {
+        return(ENERGY_PHASES + BUILT_IN_LIGHT_GAMES + (overlay->lightGame & ~UPLOADED_LIGHT_GAME));
+      }
+      return(ENERGY_PHASES + overlay->lightGame);
+    }
+  }
+  return(currentPhase == 'R' ? 1 : currentPhase == 'B' ? 2 : 0);
+}
+
+// Adds the time since the last accounting to the leds shown and to their source.
+void accountEnergy() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - lastEnergyTime;
+  lastEnergyTime = now;
+  byte ledsOn = 0;
+  for(byte led = 0; led < LEDS; led++) {
+    if(shownLeds & (1 << led)) {
+      ledOnMillis[led] += elapsed;
+      ledsOn++;
+    }
+  }
+  sourceMillis[shownSource] += elapsed;
+  sourceLedMillis[shownSource] += elapsed * ledsOn;
+}
+
+// Answers a "NRG" code with the totals, and a "NRG<source>" one with that source, so every line is short.
+void reportEnergy(String code) {
+  accountEnergy();
+  if(code.length() == 3) {
+    if(!beginReply(ENERGY_REPLY_LENGTH)) {
+      return;
+    }
+    uart.print("NRG");
+    printClock(deviceClock());
+    uart.print(',');
+    uart.print(buzzerMillis);
+    for(byte led = 0; led < LEDS; led++) {
+      uart.print(',');
+      uart.print(ledOnMillis[led]);
+    }
+    endReply();
+    return;
+  }
+  long source = code.substring(3).toInt();
+  if(source < 0 || source >= ENERGY_SOURCES || !beginReply(6 + 2 * 11 + 2)) {
+    return;
+  }
+  uart.print(code);
+  uart.print(',');
+  uart.print(sourceMillis[source]);
+  uart.print(',');
+  uart.print(sourceLedMillis[source]);
+  endReply();
+}
+
+// Writes an event in the flight recorder, over the oldest one. Returns the record.
+FlightRecord* recordFlight(char kind, byte high, byte low) {
+  FlightRecord* record = &flightRecorder[flightRecords & (FLIGHT_RECORDER_SIZE - 1)];
+  record->time = millis();
+  record->kind = kind;
+  record->data = (high << 8) | low;
+  flightRecords++;
+  return(record);
+}
+
+// Answers a "FLR" code with the clocks and the records written so far, and a "FLR<record>" one with the records from that one on, so every
+// line is short. Records already written over are skipped.
+void reportFlightRecorder(String code) {
+  if(code.length() == 3) {
+    if(!beginReply(3 + 12 + 1 + 13 + 1 + 10 + 2)) {
+      return;
+    }
+    uart.print("FLR");
+    printClock(deviceClock());
+    uart.print(',');
+    if(hostClockSynced) {
+      printClock(hostClock());
+    } else {
+      uart.print('-');
+    }
+    uart.print(',');
+    uart.print(flightRecords);
+    endReply();
+    return;
+  }
+  unsigned long first = code.substring(3).toInt();
+  if(flightRecords > FLIGHT_RECORDER_SIZE && first < flightRecords - FLIGHT_RECORDER_SIZE) {
+    first = flightRecords - FLIGHT_RECORDER_SIZE;
+  }
+  // records of 12 characters, comma included
+  if(!beginReply(3 + 10 + FLIGHT_RECORDS_PER_REPLY * 12 + 2)) {
+    return;
+  }
+  uart.print("FLR");
+  uart.print(first);
+  for(unsigned long index = first; index < flightRecords && index < first + FLIGHT_RECORDS_PER_REPLY; index++) {
+    FlightRecord* record = &flightRecorder[index & (FLIGHT_RECORDER_SIZE - 1)];
+    uart.print(',');
+    printHexByte(record->time >> 16);
+    printHexByte(record->time >> 8);
+    printHexByte(record->time);
+    uart.print(record->kind);
+    printHexByte(record->data >> 8);
+    printHexByte(record->data);
+  }
+  endReply();
+}
+
+// Called when system has been turned off. Resets everything to its pristine status, light games included.
 void resetEverything() {
-  digitalWrite(2, LOW);
-  digitalWrite(3, LOW);
-  digitalWrite(4, LOW);
-  digitalWrite(5, LOW);
-  digitalWrite(6, LOW);
-  digitalWrite(7, LOW);
+  baseLeds = 0;
+  for(byte layer = 0; layer < OVERLAY_LAYERS; layer++) {
+    overlayLayers[layer].active = false;
+  }
+  lightGameQueueLength = 0;
+  // and the buzzer
+  if(melodyActive) {
+    noTone(12);
+    melodyActive = false;
+  }
+}
+
+/* UART */
+// 8 data bits, no parity, 1 stop bit, double speed so the divider is finer at high rates.
+void UartPort::begin(unsigned long bauds) {
+  unsigned int divider = (F_CPU / 4 / bauds - 1) / 2;
+  UCSR0A = _BV(U2X0);
+  UBRR0H = divider >> 8;
+  UBRR0L = divider;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+int UartPort::available() {
+  return((uartRxHead - uartRxTail) & (UART_RX_RING_SIZE - 1));
+}
+
+int UartPort::read() {
+  if(uartRxHead == uartRxTail) {
+    return(-1);
+  }
+  byte data = uartRxRing[uartRxTail];
+  uartRxTail = (uartRxTail + 1) & (UART_RX_RING_SIZE - 1);
+  return(data);
+}
+
+int UartPort::peek() {
+  if(uartRxHead == uartRxTail) {
+    return(-1);
+  }
+  return(uartRxRing[uartRxTail]);
+}
+
+int UartPort::availableForWrite() {
+  return(UART_TX_RING_SIZE - 1 - ((uartTxHead - uartTxTail) & (UART_TX_RING_SIZE - 1)));
+}
+
+// Queues a byte for the interrupt to send, never waits: a full ring drops it.
+size_t UartPort::write(uint8_t data) {
+  byte next = (uartTxHead + 1) & (UART_TX_RING_SIZE - 1);
+  if(next == uartTxTail) {
+    uartTxRingFull++;
+    return(0);
+  }
+  uartTxRing[uartTxHead] = data;
+  uartTxHead = next;
+  replyCrc = crc8(replyCrc, data);
+  byte used = (next - uartTxTail) & (UART_TX_RING_SIZE - 1);
+  if(used > uartTxPeak) {
+    uartTxPeak = used;
+  }
+  // the interrupt turns itself off when the ring is empty, if it did it right now it just runs once more
+  UCSR0B |= _BV(UDRIE0);
+  return(1);
+}
+
+// Waits until everything has been sent, the only call that waits. Not used by the loop.
+void UartPort::flush() {
+  while(uartTxHead != uartTxTail || (UCSR0B & _BV(UDRIE0))) {
+  }
+}
+
+// A byte arrived. The status goes before the data, reading the data clears it.
+ISR(USART_RX_vect) {
+  byte status = UCSR0A;
+  byte data = UDR0;
+  if(status & _BV(FE0)) {
+    // not a byte, most likely noise or a wrong rate
+    uartFramingErrors++;
+    return;
+  }
+  if(status & _BV(DOR0)) {
+    // the loop kept the interrupts off too long and bytes before this one were lost
+    uartRxOverruns++;
+  }
+  byte next = (uartRxHead + 1) & (UART_RX_RING_SIZE - 1);
+  if(next == uartRxTail) {
+    uartRxRingFull++;
+    return;
+  }
+  uartRxRing[uartRxHead] = data;
+  uartRxHead = next;
+  byte used = (next - uartRxTail) & (UART_RX_RING_SIZE - 1);
+  if(used > uartRxPeak) {
+    uartRxPeak = used;
+  }
+}
+
+// The USART can take another byte.
+ISR(USART_UDRE_vect) {
+  if(uartTxHead == uartTxTail) {
+    UCSR0B &= ~_BV(UDRIE0);
+    return;
+  }
+  UDR0 = uartTxRing[uartTxTail];
+  uartTxTail = (uartTxTail + 1) & (UART_TX_RING_SIZE - 1);
 }